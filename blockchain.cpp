@@ -3,11 +3,15 @@
 #include <cstring>
 #include <ctime>
 #include <cstdlib>
+#include <chrono>
+#include <cstdint>
 
 
 /* Custom headers */
 #include <blockchain.hpp>
 #include <hash.hpp>
+#include <hashcache.hpp>
+#include <blockstore.hpp>
 
 using namespace std;
 
@@ -17,9 +21,16 @@ using namespace std;
 static int pow_zeroes = 2;
 
 
-Block::Block() {}
+Block::Block() {
+	time = 0;
+	height = 0;
+	work = 0;
+	next = nullptr;
+	prev = nullptr;
+	memset(prev_hash, 0, sizeof(prev_hash));
+}
 
-Block::Block(char *d, int len)  {
+Block::Block(char *d, int len) : Block() {
 	this->SetData(d, len);
 }
 
@@ -34,33 +45,30 @@ int Block::SetData(char *d, int len) {
 	return 0;
 }
 
+int Block::GetHashInput(char *buf) {
+	static_assert(sizeof(hash) + sizeof(data) + sizeof(nonce) + sizeof(time) == BLOCK_MSG_LEN,
+		"block layout doesn't match BLOCK_MSG_LEN");
+
+	memcpy(buf, prev_hash, sizeof(hash));
+	memcpy(buf + sizeof(hash), data, sizeof(data));
+	memcpy(buf + sizeof(hash) + sizeof(data), nonce, sizeof(nonce));
+	memcpy(buf + sizeof(hash) + sizeof(data) + sizeof(nonce), &time, sizeof(time));
+	return 0;
+}
+
 int Block::CalculateHash(void) {
 	/* Copy everything into a continuous patch of memory before passing
-	 * it to sha256()
+	 * it to sha256_block()
 	 */
-	int size = sizeof(hash) + sizeof(data) + sizeof(nonce) + sizeof(time);
-	char *tmp = (char*)malloc(size);
-
-	if (prev == nullptr) {
-		memset(tmp, 0, sizeof(hash));
-	} else {
-		memcpy(tmp, prev->hash, sizeof(hash));
-	}
-	memcpy(tmp + sizeof(hash), data, sizeof(data));
-	memcpy(tmp + sizeof(hash) + sizeof(data), nonce, sizeof(nonce));
-	memcpy(tmp + sizeof(hash) + sizeof(data) + sizeof(nonce), &time, sizeof(time));
-	
-	char *res = sha256(tmp, size);
-	memcpy(hash, res, 32);
-	free(res);
-	free(tmp);
+	char tmp[BLOCK_MSG_LEN];
+	GetHashInput(tmp);
+	sha256_block(tmp, hash);
 	
 	return 0;
 }
 
-/* Check if hash is valid. 0 if valid, 1 if invalid */
-int Block::CheckHash(void) {
-	this->CalculateHash();
+/* Check if the hash has enough zeroes. 0 if valid, 1 if invalid */
+int Block::CheckPow(void) {
 	for (int i = 0; i < pow_zeroes; i++) {
 		if (hash[i] != '\0') {
 			return 1;
@@ -69,10 +77,42 @@ int Block::CheckHash(void) {
 	return 0;
 }
 
+/* Check if hash is valid. 0 if valid, 1 if invalid */
+int Block::CheckHash(void) {
+	/* Blocks we've already seen are just a lookup away */
+	char tmp[BLOCK_MSG_LEN];
+	GetHashInput(tmp);
+	if (!hash_cache_get(tmp, hash)) {
+		sha256_block(tmp, hash);
+		hash_cache_put(tmp, hash);
+	}
+	return this->CheckPow();
+}
+
+
+/* The amount of work a single block represents, which is how many hashes
+ * it takes to find one on average. Every block needs the same amount of
+ * zeroes for now, but fork choice goes by the sum of this rather than by
+ * length so that doesn't have to stay true.
+ */
+static uint64_t block_work(void) {
+	return (uint64_t)1 << (8 * pow_zeroes);
+}
+
+/* Key used for BlockChain::blocks */
+static string hash_key(const char *hash) {
+	return string(hash, 32);
+}
 
 BlockChain::BlockChain() {
 	first_block = nullptr;
 	last_block = nullptr;
+	store = nullptr;
+	snapshot.store(nullptr);
+	len = 0;
+	prune_depth = 0;
+	base = 0;
+	base_work = 0;
 	string genesis_data = "THIS IS THE GENESIS BLOCK.";
 	
 	this->AddData((char*)genesis_data.c_str(), genesis_data.length());
@@ -81,18 +121,54 @@ BlockChain::BlockChain() {
 BlockChain::BlockChain(char *data, int len) {
 	first_block = nullptr;
 	last_block = nullptr;
+	store = nullptr;
+	snapshot.store(nullptr);
+	this->len = 0;
+	prune_depth = 0;
+	base = 0;
+	base_work = 0;
 	this->AddData(data, len);
 }
 
 BlockChain::~BlockChain() {
-	Block *i = first_block;
+	/* Nobody can be reading anymore, so every snapshot can go, along with
+	 * whatever's been retired.
+	 */
+	delete snapshot.exchange(nullptr);
+	for (unsigned int i = 0; i < limbo.size(); i++) {
+		delete limbo[i].second;
+	}
+	limbo.clear();
+	for (unsigned int i = 0; i < retiring.size(); i++) {
+		delete retiring[i];
+	}
 	
-	while (i != nullptr) {
-		Block *n = i->next;
-		delete i;
-		i = n;
+	/* Every block, including the ones on side branches, is in blocks. */
+	for (auto &i : blocks) {
+		delete i.second;
 	}
+	blocks.clear();
+	active.clear();
+	first_block = nullptr;
+	last_block = nullptr;
 	data_list.clear();
+	delete store;
+}
+
+int BlockChain::OpenStore(string path) {
+	delete store;
+	store = new BlockStore();
+	if (store->Open(path)) {
+		delete store;
+		store = nullptr;
+		return -1;
+	}
+	
+	/* Write out whatever we already have */
+	for (Block *i = first_block; i != nullptr; i = i->next) {
+		store->Put(i->height, i);
+	}
+	return 0;
 }
 
 int BlockChain::AddData(char *data, int len) {
@@ -104,48 +180,415 @@ int BlockChain::AddData(char *data, int len) {
 	return 0;
 }
 
+Block *BlockChain::Find(char *hash) {
+	auto i = blocks.find(hash_key(hash));
+	if (i == blocks.end()) return nullptr;
+	return i->second;
+}
+
+ChainSnapshot::~ChainSnapshot() {
+	for (unsigned int i = 0; i < retired.size(); i++) {
+		delete retired[i];
+	}
+}
+
+Block *ChainSnapshot::BlockAt(int height) const {
+	if (height < base || height >= len) return nullptr;
+	Block *i = tip;
+	while (i->height > height) {
+		i = i->prev;
+	}
+	return i;
+}
+
+/* Epoch based reclamation for snapshots. Every thread that reads them has
+ * a slot with the epoch it started reading in, 0 while it isn't reading.
+ * A snapshot replaced in epoch e can only be in use by readers that
+ * started in e or before, so it's freed once every slot is 0 or after e.
+ * Slots are never freed, just handed on once their thread is gone.
+ */
+class ReaderSlot {
+public:
+	atomic<uint64_t> epoch;
+	atomic<bool> taken;
+	ReaderSlot *next;
+};
+
+static atomic<uint64_t> global_epoch(1);
+static atomic<ReaderSlot*> reader_slots(nullptr);
+
+/* Gives a thread's slot back when the thread ends */
+class SlotOwner {
+public:
+	ReaderSlot *slot = nullptr;
+	int depth = 0;
+	
+	~SlotOwner() {
+		if (slot != nullptr) slot->taken.store(false);
+	}
+};
+
+static thread_local SlotOwner reader;
+
+static ReaderSlot *reader_slot(void) {
+	if (reader.slot != nullptr) return reader.slot;
+	
+	/* Take one a thread left behind if there is one, or add a new one */
+	for (ReaderSlot *s = reader_slots.load(); s != nullptr; s = s->next) {
+		bool no = false;
+		if (s->taken.compare_exchange_strong(no, true)) {
+			reader.slot = s;
+			return s;
+		}
+	}
+	ReaderSlot *s = new ReaderSlot();
+	s->epoch.store(0);
+	s->taken.store(true);
+	s->next = reader_slots.load();
+	while (!reader_slots.compare_exchange_weak(s->next, s)) {}
+	reader.slot = s;
+	return s;
+}
+
+SnapshotGuard::SnapshotGuard(BlockChain *chain) {
+	ReaderSlot *s = reader_slot();
+	if (reader.depth++ == 0) {
+		/* Both seq_cst: the writer has to either see our epoch, or have
+		 * swapped in the new snapshot before we load it.
+		 */
+		s->epoch.store(global_epoch.load());
+	}
+	snap = chain->snapshot.load();
+}
+
+SnapshotGuard::~SnapshotGuard() {
+	if (--reader.depth == 0) {
+		reader.slot->epoch.store(0, memory_order_release);
+	}
+}
+
+void BlockChain::Publish(void) {
+	ChainSnapshot *s = new ChainSnapshot();
+	s->tip = last_block;
+	s->len = len;
+	s->base = base;
+	
+	/* Blocks retired since the last snapshot might still be in use by
+	 * anyone reading it (or an older one), so they go into limbo with it.
+	 * Anyone who could be reading an older one holds this one up too.
+	 */
+	ChainSnapshot *old = snapshot.exchange(s);
+	if (old != nullptr) {
+		old->retired.swap(retiring);
+		limbo.push_back(make_pair(global_epoch.fetch_add(1), old));
+	} else {
+		for (unsigned int i = 0; i < retiring.size(); i++) {
+			delete retiring[i];
+		}
+		retiring.clear();
+	}
+	
+	uint64_t oldest = UINT64_MAX;
+	for (ReaderSlot *r = reader_slots.load(); r != nullptr; r = r->next) {
+		uint64_t e = r->epoch.load();
+		if (e != 0 && e < oldest) oldest = e;
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i < limbo.size(); i++) {
+		if (limbo[i].first < oldest) {
+			delete limbo[i].second;
+		} else {
+			limbo[kept++] = limbo[i];
+		}
+	}
+	limbo.resize(kept);
+}
+
+/* Key for payload_index */
+static uint64_t payload_key(const char *data) {
+	char *d = sha256((void*)data, 256);
+	uint64_t key;
+	memcpy(&key, d, sizeof(key));
+	free(d);
+	return key;
+}
+
+const char *BlockChain::DataAt(int height) {
+	if (height >= base && height < len) {
+		return BlockAt(height)->data;
+	}
+	if (height >= 0 && height < len && store != nullptr) {
+		/* A record starts with the data */
+		return store->Range(height, 1);
+	}
+	return nullptr;
+}
+
+int BlockChain::FindPayload(const char *data) {
+	uint64_t key = payload_key(data);
+	size_t pos = 0;
+	int h;
+	while ((h = payload_index.Next(key, &pos)) >= 0) {
+		const char *d = DataAt(h);
+		if (d != nullptr && memcmp(d, data, 256) == 0) return h;
+	}
+	return -1;
+}
+
+int BlockChain::Lookup(char *data, int len, PayloadEntry *e) {
+	if (len < 0 || len > 256) return -1;
+	char padded[256] = {};
+	memcpy(padded, data, len);
+	
+	int h = FindPayload(padded);
+	if (h < 0) return -1;
+	e->height = h;
+	return HashAt(h, e->hash);
+}
+
+Block *BlockChain::BlockAt(int height) {
+	if (height < base || height >= len) return nullptr;
+	return active[height - base];
+}
+
+int BlockChain::HashAt(int height, char *hash) {
+	if (height < 0 || height >= len) return -1;
+	if (height < base) {
+		memcpy(hash, headers[height].hash, 32);
+	} else {
+		memcpy(hash, BlockAt(height)->hash, 32);
+	}
+	return 0;
+}
+
+Block *BlockChain::Parent(Block *b) {
+	return (b->height > base) ? b->prev : nullptr;
+}
+
+void BlockChain::SetParent(Block *b, Block *parent) {
+	b->prev = parent;
+	if (parent != nullptr) {
+		memcpy(b->prev_hash, parent->hash, 32);
+	} else if (base > 0) {
+		memcpy(b->prev_hash, headers[base - 1].hash, 32);
+	} else {
+		memset(b->prev_hash, 0, 32);
+	}
+}
+
+int BlockChain::FindParent(char *hash, Block **parent) {
+	char zero[32] = {};
+	const char *root = (base > 0) ? headers[base - 1].hash : zero;
+	if (memcmp(hash, root, 32) == 0) {
+		*parent = nullptr;
+		return 0;
+	}
+	*parent = Find(hash);
+	return (*parent == nullptr) ? -1 : 0;
+}
+
+int BlockChain::MatchesHeader(Block *b, int height) {
+	if (height < 0 || height >= base) return -1;
+	if (height == 0) {
+		memset(b->prev_hash, 0, 32);
+	} else {
+		memcpy(b->prev_hash, headers[height - 1].hash, 32);
+	}
+	b->prev = nullptr;
+	b->CheckHash();
+	return memcmp(b->hash, headers[height].hash, 32) ? -1 : 0;
+}
+
 int BlockChain::AddBlock(Block *b) {
-	b->prev = last_block;
+	return AddBlock(b, last_block);
+}
+
+int BlockChain::AddBlock(Block *b, Block *parent) {
+	/* The most common duplicate by far is a block we already have on
+	 * the active chain (e.g. the shared part of a chain sent in RETCHAIN),
+	 * which we can spot without hashing anything.
+	 */
+	Block *same = (parent == nullptr) ? first_block : parent->next;
+	if (same != nullptr && same->time == b->time
+			&& memcmp(same->nonce, b->nonce, sizeof(b->nonce)) == 0
+			&& memcmp(same->data, b->data, sizeof(b->data)) == 0) {
+		memcpy(b->hash, same->hash, sizeof(b->hash));
+		return 1;
+	}
+
+	SetParent(b, parent);
 	if (b->CheckHash()) {
 		b->prev = nullptr;
 		return -1;
 	}
 	
+	/* Might be on a side branch we already know about */
+	if (Find(b->hash) != nullptr) {
+		return 1;
+	}
+	
+	b->next = nullptr;
+	b->height = (parent == nullptr) ? base : parent->height + 1;
+	b->work = ((parent == nullptr) ? base_work : parent->work) + block_work();
+	blocks[hash_key(b->hash)] = b;
+	
+	/* Fork choice: switch to whichever tip has the most work. On a tie
+	 * we keep the tip we saw first.
+	 */
+	if (last_block == nullptr || b->work > last_block->work) {
+		Reorg(b);
+		Publish();
+	}
+	return 0;
+}
+
+/* The length of a payload, ignoring the zero padding at the end. */
+static int payload_len(const char *data) {
+	int l = 256;
+	while (l > 0 && data[l - 1] == '\0') {
+		l--;
+	}
+	return l;
+}
+
+int BlockChain::Connect(Block *b) {
 	if (last_block == nullptr) {
-		last_block = b;
 		first_block = b;
 	} else {
 		last_block->next = b;
-		last_block = b;
 	}
+	last_block = b;
 	b->next = nullptr;
+	active.push_back(b);
 	len++;
+	if (store != nullptr) {
+		store->Put(b->height, b);
+	}
+	
+	/* An earlier block with the same data keeps its entry */
+	if (FindPayload(b->data) < 0) {
+		payload_index.Insert(payload_key(b->data), b->height);
+	}
+	
+	/* Once data is in a block, we don't have to mine it anymore. */
+	for (unsigned int i = 0; i < data_list.size(); i++) {
+		if (memcmp(data_list[i].data, b->data, sizeof(b->data)) == 0) {
+			data_list.erase(data_list.begin() + i);
+			break;
+		}
+	}
+	return 0;
+}
+
+int BlockChain::Disconnect(void) {
+	Block *b = last_block;
+	if (b == nullptr) return -1;
+	
+	last_block = Parent(b);
+	if (last_block == nullptr) {
+		first_block = nullptr;
+	} else {
+		last_block->next = nullptr;
+	}
+	b->next = nullptr;
+	active.pop_back();
+	len--;
+	if (store != nullptr) {
+		store->Truncate(len);
+	}
+	
+	/* Only there if this block was the first with its data */
+	payload_index.Erase(payload_key(b->data), b->height);
+	
+	/* The data isn't in the chain anymore, so it needs to be mined again.
+	 * Blocks are disconnected from the tip backwards, so putting it in
+	 * front keeps the original order.
+	 */
+	BlockData bd;
+	memcpy(bd.data, b->data, sizeof(bd.data));
+	bd.len = payload_len(b->data);
+	data_list.insert(data_list.begin(), bd);
+	return 0;
+}
+
+int BlockChain::Reorg(Block *tip) {
+	/* Find where the new tip branches off from the active chain. Only
+	 * the blocks after that point are touched, so this costs as much
+	 * as the fork is deep, not as much as the chain is long.
+	 */
+	vector<Block*> branch;
+	Block *a = last_block;
+	Block *b = tip;
+	while (a != b) {
+		if (b == nullptr || (a != nullptr && a->height > b->height)) {
+			a = Parent(a);
+		} else {
+			branch.push_back(b);
+			b = Parent(b);
+		}
+	}
+	
+	while (last_block != a) {
+		Disconnect();
+	}
+	for (int i = branch.size() - 1; i >= 0; i--) {
+		Connect(branch[i]);
+	}
 	return 0;
 }
 
 /* The Mine() function will be called by main() in a loop with everything
- * else. Every time Mine() is called, it makes at most this many attempts
- * before giving up.
+ * else. Every time Mine() is called, it mines for as long as it's told to,
+ * checking the clock (and whether it should stop early) every this many
+ * attempts.
  */
-static int mine_attempts = 100000;
+#define MINE_CHECK_EVERY 2048
 
-int BlockChain::Mine(void) {
+int BlockChain::Mine(int64_t slice_us, int (*interrupted)(void)) {
 	if (data_list.size() == 0)
 		return 0;
-	srand(time(NULL));
-	Block *b = new Block(data_list[0].data, data_list[0].len);
+	
+	/* Seeding every call would make calls within the same second try
+	 * the exact same nonces.
+	 */
+	static bool seeded = false;
+	if (!seeded) {
+		srand(time(NULL));
+		seeded = true;
+	}
+	
+	auto deadline = chrono::steady_clock::now() + chrono::microseconds(slice_us);
+	Block *b = new Block();
+	NextBlock(b);
 	char n[32];
-	for (int i = 0; i < mine_attempts; i++) {
+	for (int i = 1; ; i++) {
+		if (i % MINE_CHECK_EVERY == 0) {
+			if (chrono::steady_clock::now() >= deadline) break;
+			if (interrupted != nullptr && interrupted()) break;
+		}
+		
 		/* Generate a random nonce */
 		for (int j = 0; j < 32; j++) {
 			n[j] = rand() % 0x100;
 		}
 		memcpy(b->nonce, n, 32);
 		
-		/* Test the generated nonce */
+		/* Test the generated nonce. This skips CheckHash, as there's
+		 * no point filling the hash cache with failed attempts.
+		 */
+		b->CalculateHash();
+		if (b->CheckPow()) {
+			continue;
+		}
+		
+		/* This one's a keeper, so AddBlock() won't have to hash it
+		 * all over again.
+		 */
+		char tmp[BLOCK_MSG_LEN];
+		b->GetHashInput(tmp);
+		hash_cache_put(tmp, b->hash);
 		if (AddBlock(b) == 0) {
-			/* valid */
-			data_list.erase(data_list.begin());
+			/* valid. AddBlock takes the data off data_list. */
 			return 1;
 		}
 	}
@@ -153,3 +596,90 @@ int BlockChain::Mine(void) {
 	return 0;
 }
 
+int BlockChain::NextBlock(Block *b) {
+	if (data_list.size() == 0) return -1;
+	b->SetData(data_list[0].data, data_list[0].len);
+	SetParent(b, last_block);
+	return 0;
+}
+
+int BlockChain::Target(void) {
+	return pow_zeroes;
+}
+
+/* Pruned mode never lets the active chain get shorter than this in memory,
+ * as that's how deep a fork can be and still be switched to.
+ */
+#define MIN_PRUNE_DEPTH 64
+
+int BlockChain::Prune(void) {
+	if (prune_depth <= 0) return 0;
+	int depth = (prune_depth < MIN_PRUNE_DEPTH) ? MIN_PRUNE_DEPTH : prune_depth;
+	if (len - base <= depth) return 0;
+	
+	/* Turn the oldest blocks into headers. Their data stays in the store,
+	 * if there is one.
+	 */
+	while (len - base > depth) {
+		Block *b = first_block;
+		BlockHeader h;
+		h.time = b->time;
+		memcpy(h.hash, b->hash, 32);
+		memcpy(h.nonce, b->nonce, 32);
+		headers.push_back(h);
+		
+		base++;
+		base_work = b->work;
+		first_block = b->next;
+		active.pop_front();
+		blocks.erase(hash_key(b->hash));
+		retiring.push_back(b);
+	}
+	/* first_block->prev now points at a block that's about to be freed.
+	 * It's left alone, as readers of older snapshots might be looking at
+	 * it, so nothing may follow prev below base (see Parent()).
+	 */
+	
+	/* Side branches that split off below base can't ever be switched to
+	 * now, so they go too. Everything that stays in the tree has to be
+	 * built on first_block. Most of the time there's no side branches at
+	 * all, and nothing to check.
+	 */
+	if (blocks.size() == (size_t)(len - base)) {
+		Publish();
+		return 0;
+	}
+	
+	unordered_map<Block*, bool> keep;
+	keep[first_block] = true;
+	vector<Block*> drop;
+	for (auto &i : blocks) {
+		vector<Block*> path;
+		Block *b = i.second;
+		bool ok = false;
+		while (1) {
+			auto k = keep.find(b);
+			if (k != keep.end()) {
+				ok = k->second;
+				break;
+			}
+			path.push_back(b);
+			if (b->height <= base || b->prev == nullptr) {
+				/* Got to the bottom without running into first_block */
+				ok = false;
+				break;
+			}
+			b = b->prev;
+		}
+		for (unsigned int j = 0; j < path.size(); j++) {
+			keep[path[j]] = ok;
+		}
+		if (!ok) drop.push_back(i.second);
+	}
+	for (unsigned int i = 0; i < drop.size(); i++) {
+		blocks.erase(hash_key(drop[i]->hash));
+		retiring.push_back(drop[i]);
+	}
+	Publish();
+	return 0;
+}
@@ -0,0 +1,135 @@
+/* Standard libraries */
+#include <cstring>
+#include <cstdlib>
+#include <string>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/* Custom headers */
+#include <blockchain.hpp>
+#include <blockstore.hpp>
+
+using namespace std;
+
+/* The file grows at least this many records at a time */
+#define STORE_MIN_RECORDS 1024
+
+BlockStore::BlockStore() {
+	count = 0;
+	fd = -1;
+	map = nullptr;
+	capacity = 0;
+}
+
+BlockStore::~BlockStore() {
+#ifndef _WIN32
+	if (map != nullptr) munmap(map, capacity * BLOCK_RECORD_LEN);
+	if (fd >= 0) close(fd);
+#else
+	free(map);
+#endif
+}
+
+int BlockStore::Open(string path) {
+#ifndef _WIN32
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return -1;
+#else
+	/* No mmap here, so the records just live in memory. */
+	(void)path;
+#endif
+	count = 0;
+	return Reserve(STORE_MIN_RECORDS);
+}
+
+int BlockStore::Reserve(size_t n) {
+	if (n <= capacity) return 0;
+	size_t ncap = capacity ? capacity : STORE_MIN_RECORDS;
+	while (ncap < n) ncap *= 2;
+	
+#ifndef _WIN32
+	if (fd < 0) return -1;
+	if (ftruncate(fd, ncap * BLOCK_RECORD_LEN)) return -1;
+	if (map != nullptr) munmap(map, capacity * BLOCK_RECORD_LEN);
+	void *m = mmap(nullptr, ncap * BLOCK_RECORD_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		map = nullptr;
+		capacity = 0;
+		count = 0;
+		return -1;
+	}
+	map = (char*)m;
+#else
+	char *m = (char*)realloc(map, ncap * BLOCK_RECORD_LEN);
+	if (m == nullptr) return -1;
+	map = m;
+#endif
+	capacity = ncap;
+	return 0;
+}
+
+int BlockStore::Put(int height, Block *b) {
+	if (height < 0 || height > count) return -1;
+	if (Reserve(height + 1)) return -1;
+	
+	char *rec = map + (size_t)height * BLOCK_RECORD_LEN;
+	memcpy(rec, b->data, 256);
+	memcpy(rec + 256, b->nonce, 32);
+	memcpy(rec + 256 + 32, &b->time, 8);
+	count = height + 1;
+	return 0;
+}
+
+int BlockStore::Truncate(int n) {
+	if (n < 0 || n > count) return -1;
+	count = n;
+	return 0;
+}
+
+char *BlockStore::Range(int from, int n) {
+	if (map == nullptr || from < 0 || n < 0 || from + n > count) return nullptr;
+	return map + (size_t)from * BLOCK_RECORD_LEN;
+}
+
+int BlockStore::SendTo(int sock_fd, int from, int n, size_t off, size_t max) {
+	if (Range(from, n) == nullptr) return -1;
+	size_t left = (size_t)n * BLOCK_RECORD_LEN;
+	if (off >= left) return 0;
+	if (max > left - off) max = left - off;
+	
+#ifdef __linux__
+	/* sendfile() has no flag for not waiting, so the socket is made
+	 * non-blocking just for this.
+	 */
+	int flags = fcntl(sock_fd, F_GETFL);
+	if (flags < 0) return -1;
+	fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK);
+	off_t pos = (off_t)from * BLOCK_RECORD_LEN + off;
+	ssize_t r = sendfile(sock_fd, fd, &pos, max);
+	int err = errno;
+	fcntl(sock_fd, F_SETFL, flags);
+#elif !defined(_WIN32)
+	ssize_t r = send(sock_fd, map + (size_t)from * BLOCK_RECORD_LEN + off, max, MSG_DONTWAIT);
+	int err = errno;
+#else
+	/* Sockets aren't file descriptors here, see send_some() */
+	(void)sock_fd;
+	int r = -1, err = 0;
+#endif
+	
+#ifndef _WIN32
+	if (r < 0) return (err == EAGAIN || err == EWOULDBLOCK) ? 0 : -1;
+#else
+	(void)err;
+#endif
+	return r;
+}
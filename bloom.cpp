@@ -0,0 +1,52 @@
+/* Standard libraries */
+#include <cstring>
+#include <stdint.h>
+
+/* Custom headers */
+#include <bloom.hpp>
+
+/* Amount of bits set per hash */
+#define BLOOM_K 4
+
+/* The hashes we put in here are sha256 outputs already, so their words
+ * make perfectly good bit indexes on their own. The first few bytes of a
+ * block hash are always zero though, so only the back half is used.
+ */
+static uint32_t bit_index(const char *hash, int i) {
+	uint32_t w;
+	memcpy(&w, hash + 16 + i * 4, 4);
+	return w & (BLOOM_BITS - 1);
+}
+
+RollingBloom::RollingBloom(int n) {
+	memset(bits, 0, sizeof(bits));
+	current = 0;
+	count = 0;
+	per_generation = n;
+}
+
+void RollingBloom::Insert(const char *hash) {
+	if (count >= per_generation) {
+		/* Forget the oldest generation, and start filling it again */
+		current ^= 1;
+		memset(bits[current], 0, sizeof(bits[current]));
+		count = 0;
+	}
+	for (int i = 0; i < BLOOM_K; i++) {
+		uint32_t b = bit_index(hash, i);
+		bits[current][b / 8] |= 1 << (b % 8);
+	}
+	count++;
+}
+
+bool RollingBloom::Test(int gen, const char *hash) {
+	for (int i = 0; i < BLOOM_K; i++) {
+		uint32_t b = bit_index(hash, i);
+		if (!(bits[gen][b / 8] & (1 << (b % 8)))) return false;
+	}
+	return true;
+}
+
+bool RollingBloom::Contains(const char *hash) {
+	return Test(0, hash) || Test(1, hash);
+}
@@ -0,0 +1,175 @@
+/* Standard libraries */
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+
+/* Custom headers */
+#include <blockchain.hpp>
+#include <blockstore.hpp>
+#include <capture.hpp>
+#include <network.hpp>
+
+using namespace std;
+
+extern BlockChain *bc;
+
+/* Commands are recieved a byte at a time, so bytes from the same peer that
+ * come in this close together (in us) go in the same record.
+ */
+#define CAPTURE_MERGE 1000
+
+static ofstream capture_file;
+static bool capturing = false;
+static int64_t capture_begin;
+
+/* The record that's still being added to */
+static CaptureRecord pending;
+static bool have_pending = false;
+
+static int64_t now_us(void) {
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+int ReplayStream::Read(void *buf, int len) {
+	size_t n = data.length() - pos;
+	if (n > (size_t)len) n = len;
+	memcpy(buf, &data[pos], n);
+	pos += n;
+	return n;
+}
+
+static void write_pending(void) {
+	if (!have_pending) return;
+	uint32_t len = pending.data.length();
+	capture_file.write((char*)&pending.peer, sizeof(pending.peer));
+	capture_file.write((char*)&pending.time, sizeof(pending.time));
+	capture_file.write((char*)&len, sizeof(len));
+	capture_file.write(pending.data.data(), len);
+	have_pending = false;
+}
+
+int capture_start(string path) {
+	if (capturing) capture_stop();
+	capture_file.open(path, ios::binary | ios::trunc);
+	if (!capture_file) return -1;
+	capture_file.write(CAPTURE_MAGIC, 8);
+	capture_begin = now_us();
+	capturing = true;
+	return 0;
+}
+
+int capture_stop(void) {
+	if (!capturing) return -1;
+	write_pending();
+	capturing = false;
+	bool ok = capture_file.good();
+	capture_file.close();
+	return ok ? 0 : -1;
+}
+
+void capture_record(int peer, const void *buf, int len) {
+	if (!capturing) return;
+	int64_t t = now_us() - capture_begin;
+	if (have_pending && pending.peer == (uint32_t)peer && t - pending.time < CAPTURE_MERGE) {
+		pending.data.append((const char*)buf, len);
+		return;
+	}
+	write_pending();
+	pending.peer = peer;
+	pending.time = t;
+	pending.data.assign((const char*)buf, len);
+	have_pending = true;
+}
+
+int capture_load(string path, vector<CaptureRecord> *list) {
+	ifstream f(path, ios::binary);
+	char magic[8];
+	if (!f.read(magic, 8) || memcmp(magic, CAPTURE_MAGIC, 8)) return -1;
+
+	CaptureRecord r;
+	uint32_t len;
+	while (f.read((char*)&r.peer, sizeof(r.peer))) {
+		if (!f.read((char*)&r.time, sizeof(r.time))) return -1;
+		if (!f.read((char*)&len, sizeof(len))) return -1;
+		r.data.resize(len);
+		if (!f.read(&r.data[0], len)) return -1;
+		list->push_back(r);
+	}
+	return 0;
+}
+
+/* Adds every block in a block file to bc. The file can have empty records
+ * at the end (see BlockStore), which is where this stops.
+ */
+static int preload(string path) {
+	ifstream f(path, ios::binary);
+	if (!f) return -1;
+
+	char rec[BLOCK_RECORD_LEN];
+	while (f.read(rec, BLOCK_RECORD_LEN)) {
+		Block *b = new Block();
+		memcpy(b->data, rec, 256);
+		memcpy(b->nonce, rec + 256, 32);
+		memcpy(&b->time, rec + 256 + 32, 8);
+		if (bc->AddBlock(b)) {
+			delete b;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Everything replay_main() does once bc is set up */
+static int replay(string path, string blocks_path, bool fast) {
+	if (blocks_path != "" && preload(blocks_path)) {
+		cout << "ERROR: Cannot read the block file" << endl;
+		return -1;
+	}
+	cout << "Chain has " << bc->len << " block(s)" << endl;
+
+	vector<CaptureRecord> records;
+	if (capture_load(path, &records)) {
+		cout << "ERROR: Cannot read the capture" << endl;
+		return -1;
+	}
+	if (records.empty()) {
+		cout << "Nothing to replay" << endl;
+		return 0;
+	}
+	cout << "Replaying " << records.size() << " record(s)";
+	cout << (fast ? " as fast as possible" : " at the original pace") << endl;
+
+	int64_t start = now_us();
+	replay_network(records, fast);
+	int64_t took = now_us() - start;
+
+	uint64_t count = print_cmd_stats();
+	cout << "Took " << took / 1000 << "ms";
+	if (took > 0) {
+		cout << " (" << (count * 1000000 / took) << " commands/s)";
+	}
+	cout << ", chain now has " << bc->len << " block(s)" << endl;
+	return 0;
+}
+
+int replay_main(string path, string blocks_path, bool fast) {
+	bc = new BlockChain();
+	
+	/* A live node always has a store and serves GETCHAIN/GETRANGE from
+	 * it, so the replay gets one too. It's only kept for this run.
+	 */
+	string store_path = "replay_" + to_string(now_us()) + ".dat";
+	if (bc->OpenStore(store_path)) {
+		cout << "ERROR: Cannot create " << store_path << endl;
+		delete bc;
+		return -1;
+	}
+	
+	int r = replay(path, blocks_path, fast);
+	delete bc;
+	remove(store_path.c_str());
+	return r;
+}
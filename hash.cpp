@@ -3,6 +3,9 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <iostream>
+#include <utility>
+
+#include <hash.hpp>
 
 
 /* This is a hard-coded table of "round constants"
@@ -11,7 +14,7 @@
  * instead of hard-coding these, but I really don't see any benefit to doing
  * so.
  */
-static uint32_t k[64] = {
+static constexpr uint32_t k[64] = {
 	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
 	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
 	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
@@ -23,10 +26,19 @@ static uint32_t k[64] = {
 };
 
 /* Rotate right (magic!!) */
-static uint32_t ror(uint32_t n, int r) {
+static constexpr uint32_t ror(uint32_t n, int r) {
 	return (n >> r) | (n << (32 - r));
 }
 
+/* The two "small sigma" functions used when extending the message schedule */
+static constexpr uint32_t sig0(uint32_t x) {
+	return ror(x, 7) ^ ror(x, 18) ^ (x >> 3);
+}
+
+static constexpr uint32_t sig1(uint32_t x) {
+	return ror(x, 17) ^ ror(x, 19) ^ (x >> 10);
+}
+
 /* We're using sha256, because it's secure enough (not that it needs to be for this test app, anyway)
  * and it's so popular it basically took 5 seconds to find a good, detailed description of the algorithm.
  * NOTE: this function probably isn't very memory-efficient, as it makes a basically 1-to-1 copy of the
@@ -141,6 +153,182 @@ char *sha256(void *data, uint64_t len) {
 }
 
 
+/* Everything below is a version of sha256() specialised for messages of a
+ * length known at compile time. Block::CalculateHash always hashes exactly
+ * BLOCK_MSG_LEN bytes, and both mining and validation do that an awful lot,
+ * so it's worth not paying for the generic version there.
+ *
+ * Since the length is fixed, the padding and the length words of the last
+ * chunk are constants, and so is a good part of the message schedule built
+ * from them. tail_schedule holds those constant parts, worked out by the
+ * compiler. var[] says whether a word also depends on the message itself.
+ */
+struct tail_schedule {
+	uint32_t w[64];
+	bool var[64];
+};
+
+static constexpr tail_schedule make_tail_schedule(uint64_t len) {
+	tail_schedule t = {};
+	uint64_t tail = len % 64;
+	uint64_t bits = len * 8;
+
+	/* The last chunk as it would be after padding, with the message
+	 * bytes left as zero.
+	 */
+	for (int i = 0; i < 16; i++) {
+		uint32_t v = 0;
+		for (int b = 0; b < 4; b++) {
+			uint64_t pos = i * 4 + b;
+			uint32_t byte = 0;
+			if (pos == tail) {
+				byte = 0x80;
+			} else if (pos >= 56) {
+				byte = (bits >> (8 * (63 - pos))) & 0xFF;
+			}
+			v = (v << 8) | byte;
+		}
+		t.w[i] = v;
+		t.var[i] = (uint64_t)i * 4 < tail;
+	}
+
+	/* Same as the extension in sha256(), but only the terms that come
+	 * from constant words are summed up here.
+	 */
+	for (int j = 16; j < 64; j++) {
+		uint32_t c = 0;
+		if (!t.var[j-16]) c += t.w[j-16];
+		if (!t.var[j-15]) c += sig0(t.w[j-15]);
+		if (!t.var[j-7])  c += t.w[j-7];
+		if (!t.var[j-2])  c += sig1(t.w[j-2]);
+		t.w[j] = c;
+		t.var[j] = t.var[j-16] || t.var[j-15] || t.var[j-7] || t.var[j-2];
+	}
+	return t;
+}
+
+/* One round of compression. Instead of shuffling a..h around after every
+ * round, the round number decides which slot of v holds which variable.
+ */
+template <int J>
+static inline void sha_round(uint32_t *v, uint32_t kw) {
+	uint32_t &a = v[(64 + 0 - J) & 7];
+	uint32_t &b = v[(64 + 1 - J) & 7];
+	uint32_t &c = v[(64 + 2 - J) & 7];
+	uint32_t &d = v[(64 + 3 - J) & 7];
+	uint32_t &e = v[(64 + 4 - J) & 7];
+	uint32_t &f = v[(64 + 5 - J) & 7];
+	uint32_t &g = v[(64 + 6 - J) & 7];
+	uint32_t &h = v[(64 + 7 - J) & 7];
+
+	uint32_t tmp1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ ((~e) & g)) + kw;
+	uint32_t tmp2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+	d += tmp1;
+	h = tmp1 + tmp2;
+}
+
+/* All 64 rounds, fully unrolled. */
+template <size_t... J>
+static inline void compress(uint32_t *hs, const uint32_t *w, std::index_sequence<J...>) {
+	uint32_t v[8] = { hs[0], hs[1], hs[2], hs[3], hs[4], hs[5], hs[6], hs[7] };
+	(sha_round<J>(v, k[J] + w[J]), ...);
+	for (int i = 0; i < 8; i++) {
+		hs[i] += v[i];
+	}
+}
+
+/* Generic message schedule extension, unrolled. */
+template <size_t... J>
+static inline void extend(uint32_t *w, std::index_sequence<J...>) {
+	((w[J + 16] = w[J] + sig0(w[J + 1]) + w[J + 9] + sig1(w[J + 14])), ...);
+}
+
+static inline uint32_t load_be32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+template <uint64_t LEN>
+struct fixed_sha256 {
+	static constexpr uint64_t full_chunks = LEN / 64;
+	static constexpr uint64_t tail = LEN % 64;
+	static constexpr tail_schedule ts = make_tail_schedule(LEN);
+
+	/* The padding and length have to fit in the last chunk. */
+	static_assert(tail + 1 + 8 <= 64, "fixed_sha256 needs the padding to fit in one chunk");
+
+	/* Word I of the last chunk: the constant padding plus whatever
+	 * message bytes fall into it.
+	 */
+	template <size_t I>
+	static inline uint32_t tail_word(const unsigned char *p) {
+		uint32_t v = ts.w[I];
+		if constexpr (ts.var[I]) {
+			for (uint64_t b = 0; b < 4 && I * 4 + b < tail; b++) {
+				v |= (uint32_t)p[I * 4 + b] << (24 - 8 * b);
+			}
+		}
+		return v;
+	}
+
+	/* Word J (J >= 16) of the last chunk's schedule. Constant words and
+	 * constant terms come straight from ts.
+	 */
+	template <size_t J>
+	static inline uint32_t tail_ext(const uint32_t *w) {
+		uint32_t v = ts.w[J];
+		if constexpr (ts.var[J]) {
+			if constexpr (ts.var[J-16]) v += w[J-16];
+			if constexpr (ts.var[J-15]) v += sig0(w[J-15]);
+			if constexpr (ts.var[J-7])  v += w[J-7];
+			if constexpr (ts.var[J-2])  v += sig1(w[J-2]);
+		}
+		return v;
+	}
+
+	template <size_t... I>
+	static inline void load_tail(uint32_t *w, const unsigned char *p, std::index_sequence<I...>) {
+		((w[I] = tail_word<I>(p)), ...);
+	}
+
+	template <size_t... J>
+	static inline void extend_tail(uint32_t *w, std::index_sequence<J...>) {
+		((w[J + 16] = tail_ext<J + 16>(w)), ...);
+	}
+
+	static void hash(const void *data, char *out) {
+		const unsigned char *msg = (const unsigned char*)data;
+		uint32_t hs[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+		};
+		uint32_t w[64];
+
+		for (uint64_t c = 0; c < full_chunks; c++) {
+			for (int j = 0; j < 16; j++) {
+				w[j] = load_be32(msg + c * 64 + j * 4);
+			}
+			extend(w, std::make_index_sequence<48>());
+			compress(hs, w, std::make_index_sequence<64>());
+		}
+
+		load_tail(w, msg + full_chunks * 64, std::make_index_sequence<16>());
+		extend_tail(w, std::make_index_sequence<48>());
+		compress(hs, w, std::make_index_sequence<64>());
+
+		for (int i = 0; i < 8; i++) {
+			out[i * 4 + 0] = (hs[i] >> 24) & 0xFF;
+			out[i * 4 + 1] = (hs[i] >> 16) & 0xFF;
+			out[i * 4 + 2] = (hs[i] >> 8) & 0xFF;
+			out[i * 4 + 3] = hs[i] & 0xFF;
+		}
+	}
+};
+
+void sha256_block(const void *data, char *out) {
+	fixed_sha256<BLOCK_MSG_LEN>::hash(data, out);
+}
+
+
 /* Some helpers */
 
 /* Get a hexadecimal digit as a character */
@@ -163,3 +351,13 @@ void print_hash(char *hash) {
 		std::cout << get_hex_digit((val / 16) & 0x0F) << get_hex_digit(val & 0x0F);
 	}
 }
+
+std::string hex_hash(const char *hash) {
+	std::string r;
+	for (int i = 0; i < 32; i++) {
+		uint32_t val = hash[i] & 0xFF;
+		r += get_hex_digit((val / 16) & 0x0F);
+		r += get_hex_digit(val & 0x0F);
+	}
+	return r;
+}
@@ -0,0 +1,59 @@
+/* Standard libraries */
+#include <cstring>
+#include <stdint.h>
+
+/* Custom headers */
+#include <hash.hpp>
+#include <hashcache.hpp>
+
+/* Amount of slots in the cache. Must be a power of two. Each slot is a bit
+ * less than 400 bytes, so this is about 800KiB.
+ */
+#define HASH_CACHE_SLOTS 2048
+
+struct hash_cache_slot {
+	char msg[BLOCK_MSG_LEN];
+	char hash[32];
+	bool used;
+};
+
+static hash_cache_slot slots[HASH_CACHE_SLOTS];
+static uint64_t hits;
+static uint64_t misses;
+
+/* Picks the slot for a message. This doesn't need to be secure, just cheap
+ * and reasonably well spread, so it's FNV-1a over 8-byte words instead of
+ * single bytes.
+ */
+static unsigned int slot_of(const char *msg) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i + 8 <= BLOCK_MSG_LEN; i += 8) {
+		uint64_t w;
+		memcpy(&w, msg + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	return (h ^ (h >> 32)) & (HASH_CACHE_SLOTS - 1);
+}
+
+int hash_cache_get(const char *msg, char *out) {
+	hash_cache_slot *s = &slots[slot_of(msg)];
+	if (s->used && memcmp(s->msg, msg, BLOCK_MSG_LEN) == 0) {
+		memcpy(out, s->hash, 32);
+		hits++;
+		return 1;
+	}
+	misses++;
+	return 0;
+}
+
+void hash_cache_put(const char *msg, const char *hash) {
+	hash_cache_slot *s = &slots[slot_of(msg)];
+	memcpy(s->msg, msg, BLOCK_MSG_LEN);
+	memcpy(s->hash, hash, 32);
+	s->used = true;
+}
+
+void hash_cache_stats(uint64_t *h, uint64_t *m) {
+	*h = hits;
+	*m = misses;
+}
@@ -1,8 +1,35 @@
 #ifndef BLOCKCHAIN_H
 #define BLOCKCHAIN_H 1
 
+#include <atomic>
+#include <deque>
 #include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#include <payloadindex.hpp>
+
+class BlockStore;
+
+/* What's left of a block of the active chain once it's been pruned: enough
+ * to know it's there and check the blocks after it, but not its data.
+ * Headers are kept in order of height, so the header before header i is
+ * simply header i - 1.
+ */
+class BlockHeader {
+public:
+	int64_t time;
+	char hash[32];
+	char nonce[32];
+};
+
+/* Where a payload was put in the active chain */
+class PayloadEntry {
+public:
+	int height;
+	char hash[32];
+};
 
 class BlockData {
 public:
@@ -21,6 +48,12 @@ public:
 	char hash[32];
 	char nonce[32];
 	
+	/* Hash of the block before this one (all zeroes for the first block).
+	 * Kept here rather than read through prev, since in pruned mode the
+	 * block before might not be in memory at all.
+	 */
+	char prev_hash[32];
+	
 	/* if no data is supplied on initialisation, the block waits*/
 	Block();
 	
@@ -29,25 +62,136 @@ public:
 	/* Sets the time as well . */
 	int SetData(char *d, int len);
 	
+	/* Writes the BLOCK_MSG_LEN bytes that get hashed into buf */
+	int GetHashInput(char *buf);
+	
 	/* Copies the result into hash */
 	int CalculateHash(void);
 	
-	/* 0 -> valid hash , 1 -> invalid hash*/
+	/* Checks the hash that's already there, without recalculating.
+	 * 0 -> enough zeroes, 1 -> not enough
+	 */
+	int CheckPow(void);
+	
+	/* Recalculates the hash (or finds it in the hash cache) and checks it.
+	 * 0 -> valid hash , 1 -> invalid hash
+	 */
 	int CheckHash(void);
 	
-	/* Doubly linked list */
+	/* Height in the chain (the first block is 0), and the total work of
+	 * this block and every block before it. Set when added to a chain.
+	 */
+	int height;
+	uint64_t work;
+	
+	/* Doubly linked list. prev always points to the block before this
+	 * one (or is nullptr if that block was pruned), but next is only set on
+	 * the active chain, as a block on a side branch might have several
+	 * blocks built on top of it.
+	 */
 	Block *next;
 	Block *prev;
 };
 
+/* An immutable view of the active chain at some point in time. Readers on
+ * any thread can pin the latest one with a SnapshotGuard and use it
+ * without locking, while the chain moves on: blocks are never changed once
+ * they're in a chain, and neither a replaced snapshot nor the blocks that
+ * left the chain after it are freed until every reader that could still
+ * see them is done (see Publish()).
+ * Only the blocks from base up are in here. Pruned headers and the block
+ * file belong to the thread that changes the chain.
+ * NOTE: only ever walk backwards (with BlockAt or prev, down to base), as
+ * next pointers belong to whatever the chain looks like right now.
+ */
+class ChainSnapshot {
+public:
+	Block *tip;
+	int len;
+	
+	/* Blocks below this height were pruned */
+	int base;
+	
+	/* The block at the given height, nullptr if it isn't there */
+	Block *BlockAt(int height) const;
+	
+	/* Blocks that left the chain after this snapshot was taken. They're
+	 * freed along with it. Only the chain touches these.
+	 */
+	std::vector<Block*> retired;
+	
+	~ChainSnapshot();
+};
+
+class BlockChain;
+
+/* Pins the latest snapshot of a chain for as long as it's around. Guards
+ * can be nested, and are cheap: two atomic stores and a load, no locks.
+ * Keep them short though, as nothing replaced while one is around can be
+ * freed.
+ */
+class SnapshotGuard {
+public:
+	/* nullptr if nothing's been published yet */
+	const ChainSnapshot *snap;
+	
+	SnapshotGuard(BlockChain *chain);
+	~SnapshotGuard();
+	
+	SnapshotGuard(const SnapshotGuard&) = delete;
+	SnapshotGuard &operator=(const SnapshotGuard&) = delete;
+};
+
+/* Keeps every valid block it was given as a tree, so competing chains can
+ * be kept around without copying. first_block ... last_block is the active
+ * chain, which always ends at the tip with the most work.
+ */
 class BlockChain {
 public:
 	Block *first_block;
 	Block *last_block;
 
+	/* Length of the active chain */
 	int len;
 	std::vector<BlockData> data_list;
 	
+	/* Pruned mode: if prune_depth isn't 0, only the last prune_depth
+	 * blocks of the active chain are kept as Blocks. Anything older is
+	 * turned into a header (the data is still in the store, if there is
+	 * one). first_block is then at height base, and base_work is the
+	 * work of everything before it.
+	 */
+	int prune_depth;
+	int base;
+	uint64_t base_work;
+	std::vector<BlockHeader> headers;
+	
+	/* Every block in the tree, by hash */
+	std::unordered_map<std::string, Block*> blocks;
+	
+	/* The active chain from base up, by height - base */
+	std::deque<Block*> active;
+	
+	/* Where every payload on the active chain is, keyed by the first 8
+	 * bytes of the sha256 of its data (all 256 bytes, padding included).
+	 * If the same data is in the chain more than once, only the first
+	 * time is in here. Kept up to date as blocks are connected and
+	 * disconnected, pruned blocks included.
+	 */
+	PayloadIndex payload_index;
+	
+	/* Latest published snapshot (read it through a SnapshotGuard), blocks
+	 * that have left the chain since, and replaced snapshots that are
+	 * waiting for their readers, along with the epoch they were replaced
+	 * in (see Publish()).
+	 */
+	std::atomic<ChainSnapshot*> snapshot;
+	std::vector<Block*> retiring;
+	std::vector<std::pair<uint64_t, ChainSnapshot*>> limbo;
+	
+	/* On-disk copy of the active chain, if OpenStore() was called */
+	BlockStore *store;
+	
 	BlockChain();
 	BlockChain(char *genesis_data, int len);
 	~BlockChain();
@@ -57,8 +201,25 @@ public:
 	 */
 	int Genesis(char *data, int len);
 	
-	/* Mines for the next dat on data_list. */
-	int Mine(void);
+	/* Keeps a copy of the active chain in a block store at path from
+	 * now on (see blockstore.hpp).
+	 */
+	int OpenStore(std::string path);
+	
+	/* Mines for the next dat on data_list, for slice_us microseconds or
+	 * until interrupted (if not nullptr) returns non-zero, whichever comes
+	 * first. 1 if a block was mined.
+	 */
+	int Mine(int64_t slice_us, int (*interrupted)(void));
+	
+	/* Sets up b as the block Mine() would be mining right now: the next
+	 * dat on data_list on top of last_block, with no nonce yet. -1 if
+	 * there's nothing to mine.
+	 */
+	int NextBlock(Block *b);
+	
+	/* Amount of zero bytes a block's hash has to start with */
+	int Target(void);
 	
 	/* Adds data to the list of data that will be mined with Mine() */
 	int AddData(char *data, int len);
@@ -68,6 +229,82 @@ public:
 	 * in data_list will remove that data from the list.
 	 */
 	int AddBlock(Block *b);
+	
+	/* Adds the block on top of parent (nullptr for a new first block),
+	 * switching to it if it makes a chain with more work than ours.
+	 * 0  -> added, the chain owns b now.
+	 * 1  -> we already have this block, b is untouched and its hash is set.
+	 * -1 -> invalid block.
+	 */
+	int AddBlock(Block *b, Block *parent);
+	
+	/* The block with the given hash, anywhere in the tree. */
+	Block *Find(char *hash);
+	
+	/* Looks for a block on the active chain with the given data. 0 and
+	 * *e filled in if there is one, -1 if not.
+	 */
+	int Lookup(char *data, int len, PayloadEntry *e);
+	
+	/* The block at the given height on the active chain. nullptr if it
+	 * isn't there, or has been pruned.
+	 */
+	Block *BlockAt(int height);
+	
+	/* The data of the block at the given height on the active chain,
+	 * read from the store if it's been pruned. nullptr if we don't have it.
+	 */
+	const char *DataAt(int height);
+	
+	/* Height of the first block on the active chain with the given data
+	 * (all 256 bytes), -1 if there is none.
+	 */
+	int FindPayload(const char *data);
+	
+	/* Copies the hash of the block at the given height on the active
+	 * chain into hash, pruned blocks included. -1 if there's no such block.
+	 */
+	int HashAt(int height, char *hash);
+	
+	/* Makes the current state of the active chain the latest snapshot,
+	 * and frees the replaced ones nobody can see anymore.
+	 */
+	void Publish(void);
+	
+	/* The block before b, or nullptr if that's been pruned. Use this
+	 * instead of prev on anything that could be at height base.
+	 */
+	Block *Parent(Block *b);
+	
+	/* Points b at parent, which can be nullptr for the first block we
+	 * have in memory (see base).
+	 */
+	void SetParent(Block *b, Block *parent);
+	
+	/* Finds the block with the given hash for use as a parent: 0 and
+	 * *parent set if we know it, -1 if we don't.
+	 */
+	int FindParent(char *hash, Block **parent);
+	
+	/* Checks if b (which has no prev_hash yet) is the block at height on
+	 * our chain, for heights that have been pruned. 0 if it is.
+	 */
+	int MatchesHeader(Block *b, int height);
+	
+	/* Turns blocks that are more than prune_depth blocks deep into
+	 * headers, and drops side branches that split off before them.
+	 */
+	int Prune(void);
+	
+	/* Makes tip the end of the active chain. Only the blocks after the
+	 * point where the two chains split are touched. Data from blocks
+	 * that leave the active chain goes back to data_list.
+	 */
+	int Reorg(Block *tip);
+	
+	/* Appends a block to / removes the last block from the active chain */
+	int Connect(Block *b);
+	int Disconnect(void);
 };
 
 
@@ -0,0 +1,60 @@
+#ifndef BLOCKSTORE_H
+#define BLOCKSTORE_H 1
+
+#include <stddef.h>
+#include <string>
+
+class Block;
+
+/* Size of one block record: data, nonce and time. This is exactly what
+ * goes over the network for a block, so records can be sent as they are.
+ */
+#define BLOCK_RECORD_LEN (256 + 32 + 8)
+
+/* Keeps the active chain as an array of block records in a memory-mapped
+ * file, one record per height. Serving blocks to peers is then a single
+ * write straight out of the mapping, instead of a few small writes for
+ * every block in the list.
+ */
+class BlockStore {
+public:
+	/* Amount of records in the store */
+	int count;
+	
+	BlockStore();
+	~BlockStore();
+	
+	/* Opens (and empties) the file at path. 0 on success. */
+	int Open(std::string path);
+	
+	/* Writes b as the record at height, dropping everything after it.
+	 * height can be at most count.
+	 */
+	int Put(int height, Block *b);
+	
+	/* Drops every record from height count onwards. */
+	int Truncate(int count);
+	
+	/* Pointer to count records, starting at height from. nullptr if any of
+	 * them aren't in the store. Only valid until the next Put().
+	 */
+	char *Range(int from, int count);
+	
+	/* Sends up to max bytes of the count records starting at height from,
+	 * skipping the first off bytes, straight from the file to the socket
+	 * sock_fd (with sendfile where there is one). Doesn't wait for the
+	 * socket: returns how much it took, which is 0 if it's full, or -1 on
+	 * error or if any of the records aren't in the store.
+	 */
+	int SendTo(int sock_fd, int from, int count, size_t off, size_t max);
+	
+private:
+	int fd;
+	char *map;
+	size_t capacity;
+	
+	/* Makes sure there's room for at least n records */
+	int Reserve(size_t n);
+};
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef BLOOM_H
+#define BLOOM_H 1
+
+#include <stdint.h>
+
+/* Bits in each generation of a RollingBloom (must be a power of two) */
+#define BLOOM_BITS (1 << 16)
+
+/* A set of block hashes that never grows: a Bloom filter split into two
+ * generations. New hashes go into the current one, and once that has seen
+ * enough hashes the older one is cleared and they swap places. So a hash
+ * is remembered for at least per_generation inserts, with a small chance of
+ * false positives and no false negatives within that window.
+ */
+class RollingBloom {
+public:
+	RollingBloom(int per_generation);
+	
+	/* hash is 32 bytes, e.g. Block::hash */
+	void Insert(const char *hash);
+	bool Contains(const char *hash);
+	
+private:
+	uint8_t bits[2][BLOOM_BITS / 8];
+	int current;
+	int count;
+	int per_generation;
+	
+	bool Test(int gen, const char *hash);
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H 1
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Records everything our peers send us, so the exact same traffic can be
+ * played back later against the command handlers (see replay_network()),
+ * without any sockets involved.
+ *
+ * A capture file is CAPTURE_MAGIC, followed by records of:
+ *   uint32 peer id, int64 time (us since the capture started),
+ *   uint32 length, and then that many bytes.
+ * Numbers are in whatever byte order the machine uses.
+ */
+#define CAPTURE_MAGIC "BCCAP001"
+
+class CaptureRecord {
+public:
+	uint32_t peer;
+	int64_t time;
+	std::string data;
+};
+
+/* Everything a replayed peer sends, and how far it's been read. Only the
+ * first avail bytes have "arrived" so far.
+ */
+class ReplayStream {
+public:
+	std::string data;
+	size_t pos = 0;
+	size_t avail = 0;
+
+	/* Reads up to len bytes, 0 once there's nothing left at all */
+	int Read(void *buf, int len);
+};
+
+/* Starts capturing into path (overwriting it). 0 on success */
+int capture_start(std::string path);
+
+/* Writes out what's left and closes the file */
+int capture_stop(void);
+
+/* Called with everything we recieve from peer. Does nothing unless a
+ * capture is going.
+ */
+void capture_record(int peer, const void *buf, int len);
+
+/* Reads every record in the capture at path into list. 0 on success */
+int capture_load(std::string path, std::vector<CaptureRecord> *list);
+
+/* Loads the blocks in blocks_path (a block file a node left behind, or ""
+ * for an empty chain), replays the capture at path against them, and
+ * reports how fast that went. Like a live node, the chain gets a block
+ * store, in a temporary file that's removed afterwards.
+ */
+int replay_main(std::string path, std::string blocks_path, bool fast);
+
+#endif
@@ -3,11 +3,26 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string>
 
 /* We're using sha256 as out hashing algorithm.
  * return value is a 32-byte (256-bit) large buffer that holds the hash.
  */
 char *sha256(void *data, uint64_t len);
+
+/* Length of the message Block::CalculateHash hashes: the previous hash,
+ * data, nonce and time of a block (32 + 256 + 32 + 8 bytes).
+ */
+#define BLOCK_MSG_LEN 328
+
+/* Same as sha256(), but only for messages exactly BLOCK_MSG_LEN bytes long.
+ * Much faster, as most of the work for the padding is done at compile time.
+ * The 32-byte hash is written to out instead of being malloc'd.
+ */
+void sha256_block(const void *data, char *out);
 void print_hash(char *hash);
 
+/* Same as print_hash, but returns the hex string instead */
+std::string hex_hash(const char *hash);
+
 #endif
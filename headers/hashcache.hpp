@@ -0,0 +1,21 @@
+#ifndef HASHCACHE_H
+#define HASHCACHE_H 1
+
+#include <stdint.h>
+
+/* A small, fixed-size cache of block messages (see BLOCK_MSG_LEN) we've
+ * already hashed. The same block tends to reach us several times (once
+ * from every peer that relays it, or as part of a chain we already have),
+ * and there's no point hashing it again every time.
+ */
+
+/* Returns 1 and copies the hash into out if msg is in the cache, 0 if not. */
+int hash_cache_get(const char *msg, char *out);
+
+/* Remembers hash as the hash of msg, replacing whatever was in its slot. */
+void hash_cache_put(const char *msg, const char *hash);
+
+/* How many lookups hit and missed the cache since startup. */
+void hash_cache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -3,29 +3,177 @@
 
 #include <blockchain.hpp>
 #include <ctime>
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
 #include <socket.hpp>
 
+class CaptureRecord;
+class ReplayStream;
+
 using namespace portsock;
 
+/* A message waiting in a peer's outgoing queue: a command string,
+ * whatever raw data (e.g. a block) goes right after it, and then count
+ * blocks of our chain starting at height from. The blocks aren't copied
+ * into the queue, they're read from the chain as they go out.
+ */
+class OutMsg {
+public:
+	std::string cmd;
+	std::string payload;
+	int from;
+	int count;
+	
+	/* How much of it has been sent so far */
+	size_t off;
+	
+	/* Hash of the last of the blocks when the message was queued. If
+	 * that's not on our chain anymore, the chain changed under them.
+	 */
+	std::string last_hash;
+	
+	/* The block at height cursor_at, so blocks sent from memory don't have
+	 * to be looked up one at a time. nullptr until the first one goes out.
+	 */
+	Block *cursor;
+	int cursor_at;
+	
+	OutMsg(std::string c, std::string data = "", int f = 0, int n = 0);
+	
+	/* Size of the whole message, in bytes */
+	size_t Size(void) const;
+	
+	/* How much of that is kept in the queue itself (all but the blocks) */
+	size_t Buffered(void) const;
+};
+
 class Peer {
 public:
 	Socket *sock;
+	
+	/* Only used to tell peers apart in captures */
+	int id;
+	
+	/* If not nullptr, this peer is being replayed from a capture: sock is
+	 * nullptr, everything it sends is thrown away, and everything it
+	 * recieves comes from here (see capture.hpp).
+	 */
+	ReplayStream *replay;
 
-	/* Timestamp of the last time we talked to this peer. */
-	int last_touch;
+	/* Timestamp (in ms) of the last time we heard from this peer. */
+	int64_t last_touch;
 	
 	/* was the peer active last time we attempted to interact with them? */
 	int status;
 	
+	/* When we sent the PING we're still waiting on a PONG for (0 if we
+	 * aren't waiting), and when we sent the last one at all. In ms.
+	 */
+	int64_t ping_sent;
+	int64_t last_ping;
+	
+	/* Round trip time in ms, averaged over the last few PINGs. -1 until
+	 * the first PONG.
+	 */
+	int64_t latency;
+	
+	/* Traffic counters, in bytes */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	
+	/* Messages waiting to be sent, the amount of memory they take up
+	 * (blocks are read from the chain, so they don't count), how many of
+	 * them send blocks, and how many we dropped because there were too
+	 * many already.
+	 */
+	std::deque<OutMsg> out_queue;
+	size_t queued;
+	int ranges;
+	uint64_t dropped;
+	
+	/* Last time (in ms) the queue was empty or we got to send any of it */
+	int64_t last_progress;
+	
+	/* How fast the peer takes what we send it, in bytes/s, averaged over
+	 * the last few seconds it had a backlog. -1 until it's had one long
+	 * enough to tell. busy_since is when the current backlog started (0 if
+	 * there's none) and busy_bytes is how much of it has been sent.
+	 */
+	int64_t throughput;
+	int64_t busy_since;
+	uint64_t busy_bytes;
+	
+	/* Where the pages of the peer's chain we've got lately end: the
+	 * height the next page starts at, and the hash of the block before it.
+	 * The next page goes on top of that block, which isn't on our chain
+	 * if the peer's chain is a fork.
+	 */
+	std::map<int, std::string> pages;
+	
 	Peer(Socket *s);
 	~Peer();
+	
+	/* Send/recieve right away, keeping count of the traffic. */
+	int Send(void *buf, int len);
+	int SendStr(std::string s);
+	int Recv(void *buf, int len);
+	
+	/* Same as on the socket, but work for replayed peers too */
+	void SetTimeout(int us);
+	bool CheckRead(void);
+	
+	/* 1 if something can be sent without having to wait for the peer */
+	bool CheckWrite(void);
+	
+	/* Queues a message to be sent by Flush(). If the queue is full, the
+	 * message is dropped and -1 returned. A message always fits into an
+	 * empty queue, no matter how big.
+	 */
+	int Queue(std::string cmd, std::string payload = "");
+	
+	/* Queues cmd followed by count blocks of our chain, starting at
+	 * height from. If the chain changes under those blocks before they've
+	 * all gone out, the message is dropped, or the peer if it's already
+	 * been sent part of it.
+	 */
+	int QueueRange(std::string cmd, int from, int count);
+	
+	/* Queues a small message (PING, PONG) ahead of everything that hasn't
+	 * started going out yet, so a big backlog doesn't look like latency.
+	 */
+	int QueueFirst(std::string cmd);
+	
+	/* Sends queued messages, up to roughly max_bytes, for as long as the
+	 * socket takes them without blocking. -1 on error.
+	 */
+	int Flush(size_t max_bytes);
 };
 
 int handle_network(void);
+
+/* 1 if there's an incoming connection, or a peer has sent something */
+int network_pending(void);
 int announce_last_block(void);
 int network_sync(void);
 int add_peer(std::string IP, int port);
 
+/* Prints every peer along with its latency and traffic */
+void print_peers(void);
+
+/* Prints how many of each command we've handled, and how long they took.
+ * Returns the total.
+ */
+uint64_t print_cmd_stats(void);
+
+/* Feeds captured traffic to the command handlers as if it came from real
+ * peers, at the original pace or, if fast, as quickly as possible. Whatever
+ * we'd send back is thrown away.
+ */
+int replay_network(std::vector<CaptureRecord> &records, bool fast);
+
 int init_network(std::string IP, int port);
 int network_cleanup(void);
 
@@ -0,0 +1,42 @@
+#ifndef PAYLOADINDEX_H
+#define PAYLOADINDEX_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Heights of payloads on the active chain, small enough to keep one entry
+ * for every block: a flat hash table of 12-byte slots, each holding a
+ * 64-bit key (e.g. the start of the sha256 of a payload) and a height.
+ * Different payloads can end up with the same key, so whatever's found
+ * under a key has to be checked against the actual data.
+ */
+class PayloadIndex {
+public:
+	PayloadIndex();
+	
+	void Insert(uint64_t key, int height);
+	
+	/* Removes the entry for key at height, if there is one */
+	void Erase(uint64_t key, int height);
+	
+	/* Goes through the heights stored under key. Start with *pos = 0,
+	 * each call returns the next one, or -1 once there's no more.
+	 */
+	int Next(uint64_t key, size_t *pos);
+	
+	void Clear(void);
+	
+private:
+	/* heights[i] is -1 for an empty slot. Always a power of two long,
+	 * and never more than half full.
+	 */
+	std::vector<uint64_t> keys;
+	std::vector<int32_t> heights;
+	size_t count;
+	
+	size_t Home(uint64_t key);
+	void Grow(void);
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H 1
+
+#include <string>
+
+/* Mining pool. A node started with --pool hands out mining jobs to worker
+ * processes (started with --worker), so mining isn't stuck with the CPUs
+ * of the node itself. Workers don't keep a chain or talk to peers, they
+ * just hash what they're given and say when they find something.
+ *
+ * A job is everything that gets hashed (see Block::GetHashInput) with
+ * the first 8 bytes of the nonce left for the worker to count through.
+ * The rest of the nonce is random for every job, so ranges from different
+ * jobs never overlap.
+ */
+
+/* Starts listening for workers */
+int init_pool(std::string IP, int port);
+
+/* Accepts workers and handles what they've sent, then hands out a new job
+ * if the one they're on is out of date. 1 if a worker found a block that
+ * made it into the chain.
+ */
+int handle_pool(void);
+
+/* Hands out a new job right away if the tip or the next data has changed */
+int pool_update(void);
+
+/* 1 if a worker is trying to connect or has sent something */
+int pool_pending(void);
+
+/* Prints the workers, and how many blocks they've found */
+void print_pool(void);
+
+int pool_cleanup(void);
+
+/* Runs a worker that mines for the pool at IP:port until the pool goes
+ * away. Never touches the chain.
+ */
+int worker_main(std::string IP, int port);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+/* Span tracing. Spans are recorded into a ring buffer per thread, and
+ * written out as a Chrome trace (which Perfetto and chrome://tracing can
+ * open) when tracing is stopped. While tracing is off, a span costs one
+ * relaxed atomic load.
+ */
+
+extern std::atomic<bool> trace_enabled;
+
+/* Starts recording spans, throwing away anything recorded before. */
+int trace_start(std::string path);
+
+/* Stops recording and writes everything to the file given to
+ * trace_start(). 0 on success.
+ */
+int trace_stop(void);
+
+/* Microseconds since some point in the past */
+int64_t trace_now(void);
+
+/* Records a span. name has to stay around (a string literal, say). */
+void trace_record(const char *name, int64_t start, int64_t end);
+
+/* Records a span covering its own lifetime */
+class TraceSpan {
+public:
+	TraceSpan(const char *n) {
+		if (trace_enabled.load(std::memory_order_relaxed)) {
+			name = n;
+			start = trace_now();
+		} else {
+			name = nullptr;
+		}
+	}
+	
+	~TraceSpan() {
+		if (name != nullptr) {
+			trace_record(name, start, trace_now());
+		}
+	}
+	
+private:
+	const char *name;
+	int64_t start;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+
+/* Traces the rest of the current scope as a span called name */
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+
+#endif
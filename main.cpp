@@ -1,6 +1,10 @@
 /* Standard libraries */
 #include <iostream>
 #include <string>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <vector>
 
 /* Custem headers. 
  * NOTE: socket.h is copied over from the portsock repo
@@ -10,14 +14,62 @@
  */
 #include <socket.hpp>
 #include <blockchain.hpp>
+#include <blockstore.hpp>
+#include <capture.hpp>
 #include <hash.hpp>
 #include <network.hpp>
+#include <hashcache.hpp>
+#include <pool.hpp>
+#include <trace.hpp>
 
 
 using namespace std;
 
 BlockChain *bc;
 
+static void print_block(char *data, int64_t time, char *nonce, char *hash) {
+	cout << "|\n|\n|\nv\n";
+	cout << "++====================\n";
+	cout << "|| Data  : " << string(data, strnlen(data, 256)) << "\n";
+	cout << "|| Time  : " << time << "\n";
+	cout << "|| Nonce : " << hex_hash(nonce) << "\n";
+	cout << "|| Hash  : " << hex_hash(hash) << "\n";
+	cout << "++====================\n";
+}
+
+/* Prints the blocks from height from to height to */
+static void print_chain(int from, int to) {
+	if (from < 0) from = 0;
+	if (to >= bc->len) to = bc->len - 1;
+	
+	/* Snapshots only have the blocks we keep in memory. Pruned ones only
+	 * have their data in the store, which is fine to read here as this is
+	 * the thread that changes the chain.
+	 */
+	SnapshotGuard guard(bc);
+	const ChainSnapshot *snap = guard.snap;
+	if (snap == nullptr) return;
+	int h = from;
+	for (; h <= to && h < snap->base; h++) {
+		BlockHeader &hd = bc->headers[h];
+		char *rec = (bc->store != nullptr) ? bc->store->Range(h, 1) : nullptr;
+		if (rec == nullptr) break;
+		print_block(rec, hd.time, hd.nonce, hd.hash);
+	}
+	
+	/* The rest can only be walked backwards, so collect the blocks first */
+	vector<Block*> list;
+	for (Block *i = snap->BlockAt(to); i != nullptr && i->height >= h; i = i->prev) {
+		list.push_back(i);
+		if (i->height == snap->base) break;
+	}
+	for (int j = list.size() - 1; j >= 0; j--) {
+		Block *i = list[j];
+		print_block(i->data, i->time, i->nonce, i->hash);
+	}
+	cout.flush();
+}
+
 static int handle_cmd(string cmd) {
 	if (!cmd.compare(0, 4, "exit")) {
 		return 1;
@@ -44,23 +96,181 @@ static int handle_cmd(string cmd) {
 		} else {
 			cout << "Successfully added peer" << endl;
 		}
-	} else if (!cmd.compare(0, 5, "print")) {
-		Block *i = bc->first_block;
-		while (i != nullptr) {
-			cout << "|\n|\n|\nv\n";
-			cout << "++====================" << endl;
-			cout << "|| Data  : " << i->data << endl;
-			cout << "|| Time  : " << i->time << endl;
-			cout << "|| Nonce : "; print_hash(i->nonce); cout << endl;
-			cout << "|| Hash  : "; print_hash(i->hash); cout << endl;
-			cout << "++====================" << endl;
-			i = i->next;
+	} else if (!cmd.compare(0, 12, "trace start ")) {
+		if (cmd.length() < 13) return 0;
+		trace_start(cmd.substr(12));
+		cout << "Tracing to " << cmd.substr(12) << endl;
+	} else if (!cmd.compare(0, 10, "trace stop")) {
+		if (trace_stop()) {
+			cout << "Couldn't write the trace" << endl;
+		} else {
+			cout << "Trace written" << endl;
+		}
+	} else if (!cmd.compare(0, 14, "capture start ")) {
+		if (cmd.length() < 15) return 0;
+		if (capture_start(cmd.substr(14))) {
+			cout << "Couldn't open " << cmd.substr(14) << endl;
+		} else {
+			cout << "Capturing peer traffic to " << cmd.substr(14) << endl;
 		}
+	} else if (!cmd.compare(0, 12, "capture stop")) {
+		if (capture_stop()) {
+			cout << "Couldn't write the capture" << endl;
+		} else {
+			cout << "Capture written" << endl;
+		}
+	} else if (!cmd.compare(0, 5, "peers")) {
+		print_peers();
+	} else if (!cmd.compare(0, 4, "pool")) {
+		print_pool();
+	} else if (!cmd.compare(0, 5, "stats")) {
+		uint64_t hits, misses;
+		hash_cache_stats(&hits, &misses);
+		cout << "Hash cache: " << hits << " hits, " << misses << " misses";
+		if (hits + misses) {
+			cout << " (" << (hits * 100 / (hits + misses)) << "% hit rate)";
+		}
+		cout << endl;
+		print_cmd_stats();
+	} else if (!cmd.compare(0, 7, "lookup ")) {
+		if (cmd.length() < 8) return 0;
+		string data = cmd.substr(7);
+		PayloadEntry e;
+		if (bc->Lookup((char*)data.c_str(), data.length(), &e)) {
+			cout << "'" << data << "' is not in the chain" << endl;
+		} else {
+			cout << "'" << data << "' is in block " << e.height << " (" << hex_hash(e.hash) << ")" << endl;
+		}
+	} else if (!cmd.compare(0, 5, "print")) {
+		/* print [from] [to], both heights, to is included */
+		int from = 0;
+		int to = bc->len - 1;
+		sscanf(cmd.c_str(), "print %d %d", &from, &to);
+		print_chain(from, to);
 	}
 	return 0;
 }
 
-int main(void) {
+/* How long Mine() gets each time around the main loop (in us). It stops
+ * early if a peer or the user wants something, so this is mostly how long
+ * periodic jobs can be late by.
+ */
+#define MINE_SLICE 20000
+
+/* How often we check our chain is as long as our peers' (in ms) */
+#define SYNC_INTERVAL 10000
+
+/* How long to wait for the user when there's nothing to mine (in us) */
+#define IDLE_WAIT 1000
+
+/* Roughly how much memory a block we keep takes: the Block itself, and
+ * its entry in BlockChain::blocks (the node, the string key, and what the
+ * key points to). Allocator overhead isn't counted, so this is on the low
+ * side.
+ */
+#define BLOCK_MEMORY (sizeof(Block) + sizeof(string) + 32 + 4 * sizeof(void*))
+
+static int64_t now_ms(void) {
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/* 1 if there's a line from the user to read. Waits at most wait_us. */
+static int stdin_ready(int wait_us) {
+	/* cin might have read it already, in which case select won't know */
+	if (cin.rdbuf()->in_avail() > 0) return 1;
+	
+	/* TODO: find a cross-platform way of doing this. Currently,
+	 * this is the ONLY reason this program isn't available on windows
+	 * without cygwin.
+	 */
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(0, &fds);
+	
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = wait_us;
+	return select(1, &fds, nullptr, nullptr, &tv) == 1;
+}
+
+/* Tells Mine() to stop so we can handle whatever came in */
+static int input_pending(void) {
+	return stdin_ready(0) || network_pending() || pool_pending();
+}
+
+int main(int argc, char **argv) {
+	/* Otherwise cin reads through stdio's buffer, which in_avail() can't
+	 * see into, and lines stuck in there wait for the next bit of input
+	 * before select() says there's anything (see stdin_ready()).
+	 */
+	ios::sync_with_stdio(false);
+	
+	/* Command line options:
+	 * --prune <n>     only keep the last n blocks in memory
+	 * --prune-mb <n>  only keep about n MiB worth of blocks in memory (a
+	 *                 rough guess, see BLOCK_MEMORY)
+	 * --trace <file>  trace everything until exit into file
+	 * --pool <port>   hand out mining jobs to workers on this port
+	 * --worker <ip> <port>
+	 *                 don't run a node at all, just mine for the pool there
+	 * --capture <file>
+	 *                 record everything peers send us into file
+	 * --replay <file> [--preload <blocks file>] [--fast]
+	 *                 don't run a node at all, just play a capture back
+	 *                 against the chain in the block file (or an empty
+	 *                 one), and report how fast that went
+	 */
+	int prune_depth = 0;
+	int pool_port = 0;
+	string replay_path = "", preload_path = "";
+	bool fast = false;
+	bool quit = false;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--prune" && i + 1 < argc) {
+			prune_depth = stoi(argv[++i]);
+			if (prune_depth <= 0) {
+				cout << "--prune needs a positive number of blocks" << endl;
+				return -1;
+			}
+		} else if (arg == "--prune-mb" && i + 1 < argc) {
+			int64_t mb = stoll(argv[++i]);
+			if (mb <= 0) {
+				cout << "--prune-mb needs a positive number of MiB" << endl;
+				return -1;
+			}
+			/* Anything past a few TiB is as good as no limit */
+			if (mb > ((int64_t)1 << 22)) mb = (int64_t)1 << 22;
+			int64_t n = mb * (1 << 20) / BLOCK_MEMORY;
+			prune_depth = (n > INT32_MAX) ? INT32_MAX : n;
+		} else if (arg == "--trace" && i + 1 < argc) {
+			trace_start(argv[++i]);
+		} else if (arg == "--pool" && i + 1 < argc) {
+			pool_port = stoi(argv[++i]);
+		} else if (arg == "--worker" && i + 2 < argc) {
+			return worker_main(argv[i + 1], stoi(argv[i + 2]));
+		} else if (arg == "--capture" && i + 1 < argc) {
+			if (capture_start(argv[++i])) {
+				cout << "ERROR: Cannot open the capture file" << endl;
+				return -1;
+			}
+		} else if (arg == "--replay" && i + 1 < argc) {
+			replay_path = argv[++i];
+		} else if (arg == "--preload" && i + 1 < argc) {
+			preload_path = argv[++i];
+		} else if (arg == "--fast") {
+			fast = true;
+		} else {
+			cout << "Unknown option " << arg << endl;
+			return -1;
+		}
+	}
+	
+	if (replay_path != "") {
+		return replay_main(replay_path, preload_path, fast);
+	}
+	
 	cout << "port to bind: ";
 	int port;
 	cin >> port;
@@ -73,33 +283,74 @@ int main(void) {
 	bc = new BlockChain();
 	cout << "Bind successful." << endl;
 	
-	int tick = 0;
+	/* Keep the chain in a file, so it can be served to peers from there */
+	if (bc->OpenStore("blocks_" + to_string(port) + ".dat")) {
+		cout << "WARNING: Cannot open the block file, serving blocks from memory" << endl;
+		/* Pruned blocks could be served from nowhere */
+		if (prune_depth > 0) {
+			cout << "WARNING: Pruning needs the block file, not pruning" << endl;
+			prune_depth = 0;
+		}
+	}
+	bc->prune_depth = prune_depth;
+	
+	if (pool_port && init_pool("127.0.0.1", pool_port)) {
+		cout << "ERROR: Cannot listen for workers on the given port" << endl;
+		return -1;
+	}
+	
+	/* Periodic jobs go by the clock rather than by counting ticks, since
+	 * how long a tick takes depends on the machine. The first sync happens
+	 * right away.
+	 */
+	int64_t next_sync = now_ms();
+	
 	/* main loop */
 	while (1) {
-		/* TODO: find a cross-platform way of doing this. Currently,
-		 * this is the ONLY reason this program isn't available on windows
-		 * without cygwin.
-		 */
-		fd_set fds;
-		FD_ZERO(&fds);
-		FD_SET(0, &fds);
+		TRACE_SPAN("tick");
 		
-		struct timeval tv;
-		tv.tv_sec = 0;
-		tv.tv_usec = 100;
-		if (select(1, &fds, nullptr, nullptr, &tv) == 1) {
+		/* If there's nothing to mine, there's no hurry, so wait a little
+		 * for the user instead of spinning.
+		 */
+		int ready;
+		{
+			TRACE_SPAN("stdin select");
+			ready = stdin_ready(bc->data_list.empty() ? IDLE_WAIT : 0);
+		}
+		while (ready) {
+			TRACE_SPAN("console command");
 			string cmd;
 			getline(cin, cmd);
 			if (handle_cmd(cmd)) {
+				quit = true;
 				break;
 			}
+			/* getline might have read more than one line */
+			ready = (cin.rdbuf()->in_avail() > 0);
 		}
+		if (quit) break;
 		
 		/* Once we're sure there's no input from user, we can go
 		 * check if any peers want stuff from us.
 		 */
-		if (handle_network()) {
-			break;
+		{
+			TRACE_SPAN("handle_network");
+			if (handle_network()) {
+				break;
+			}
+		}
+		
+		/* Workers might have found something, and need to hear about
+		 * any new blocks our peers sent.
+		 */
+		{
+			TRACE_SPAN("handle_pool");
+			if (handle_pool()) {
+				cout << "A worker mined a new block." << endl;
+				if (announce_last_block()) {
+					cout << "An error occured while announcing the new block to peers" << endl;
+				}
+			}
 		}
 		 
 		/* We also need to periodically synchronise with other peers in
@@ -108,7 +359,9 @@ int main(void) {
 		 * out-of-sync is kinda rare and only happens once a peer has
 		 * just connected to the network.
 		 */
-		if ((tick % 50000) == 0) {
+		if (now_ms() >= next_sync) {
+			TRACE_SPAN("network_sync");
+			next_sync = now_ms() + SYNC_INTERVAL;
 			if (network_sync()) {
 				/* Not sure how to deal with this, but we should probably
 				 * at least print an error message.
@@ -118,18 +371,42 @@ int main(void) {
 		}
 
 		 
-		/* Spend some time mining. */
-		if (bc->Mine()) {
+		/* Spend some time mining, unless someone wants something from
+		 * us in the meantime.
+		 */
+		int mined;
+		{
+			TRACE_SPAN("Mine");
+			mined = bc->Mine(MINE_SLICE, input_pending);
+		}
+		if (mined) {
 			cout << "A new block was successfully mined." << endl;
 			/* Announce the new block to all peers */
 			if (announce_last_block()) {
 				cout << "An error occured while announcing the new block to peers" << endl;
 			}
+			/* Workers are mining on top of the old tip */
+			pool_update();
+		}
+		
+		/* In pruned mode, drop whatever's gotten too old. This is done
+		 * here rather than when adding blocks, so blocks don't vanish
+		 * while a peer's message is being handled.
+		 */
+		{
+			TRACE_SPAN("Prune");
+			bc->Prune();
 		}
-		tick++;
 	}
 	
+	/* Write out the trace if --trace (or trace start) is still going */
+	if (trace_enabled.load()) {
+		trace_stop();
+	}
+	capture_stop();
+	
 	/* TODO: maybe save it in a file? */
+	pool_cleanup();
 	delete bc;
 	if (network_cleanup()) {
 		cout << "ERROR: network_cleanup returned an error" << endl;
@@ -3,28 +3,358 @@
 #include <cstring>
 #include <ctime>
 #include <cstdlib>
+#include <cstdio>
 
 
 /* Custom headers */
 #include <blockchain.hpp>
+#include <blockstore.hpp>
+#include <bloom.hpp>
+#include <capture.hpp>
+#include <trace.hpp>
 #include <hash.hpp>
 #include <network.hpp>
 #include <socket.hpp>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
 
 using namespace std;
 
 extern BlockChain *bc;
 
+/* Limits for the peer manager */
+
+/* Most peers we'll keep at once */
+#define MAX_PEERS 32
+/* How often we PING a peer, and how long we wait for the PONG (ms) */
+#define PING_INTERVAL 15000
+#define PING_TIMEOUT 30000
+/* Peers we haven't heard from at all in this long are dropped (ms) */
+#define PEER_TIMEOUT 60000
+/* Peers that take longer than this to answer a PING are dropped (ms) */
+#define MAX_LATENCY 5000
+/* Most bytes that can be waiting in one peer's queue, not counting blocks
+ * sent from the chain, and most messages with blocks in them.
+ */
+#define MAX_QUEUED (4 << 20)
+#define MAX_RANGES_QUEUED 4
+/* Most blocks we send in one RETCHAIN or RETRANGE. Peers page through
+ * longer chains with GETRANGE.
+ */
+#define MAX_RANGE 2000
+/* Most page ends we remember per peer (see Peer::pages) */
+#define MAX_PAGES 8
+/* Peers we haven't been able to send anything to in this long, while
+ * there's something waiting for them, are dropped (ms)
+ */
+#define STALL_TIMEOUT 30000
+/* Peers with a backlog that take less than this many bytes/s are dropped */
+#define MIN_THROUGHPUT 1024
+/* How long a backlog has to last before it tells us a peer's throughput */
+#define THROUGHPUT_WINDOW 2000
+/* How long we wait for a peer when just checking if it sent anything (us).
+ * The main loop never waits on the network, so this is as short as it gets.
+ */
+#define NET_POLL_TIMEOUT 1
+/* Most bytes sent to one peer from its queue per call to handle_network */
+#define FLUSH_BUDGET (1 << 20)
+/* Most bytes handed to the socket at once by Flush(). It takes what fits
+ * and we keep the rest for later, so this can be big.
+ */
+#define WRITE_CHUNK (1 << 20)
+/* Same, where the socket can't be told not to wait (Windows). Small enough
+ * to fit into the socket's buffer whenever it says it can be written to.
+ */
+#define WAIT_WRITE_CHUNK 4096
+
+static int64_t now_ms(void) {
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static int next_peer_id = 0;
+
 /* Define Peer a bit more */
 Peer::Peer(Socket *s) {
 	sock = s;
-	last_touch = std::time(nullptr);
+	id = next_peer_id++;
+	replay = nullptr;
+	last_touch = now_ms();
 	status = 1;
+	ping_sent = 0;
+	last_ping = 0;
+	latency = -1;
+	bytes_in = 0;
+	bytes_out = 0;
+	queued = 0;
+	ranges = 0;
+	dropped = 0;
+	last_progress = last_touch;
+	throughput = -1;
+	busy_since = 0;
+	busy_bytes = 0;
 }
 
 Peer::~Peer() {
 	delete sock;
+	delete replay;
+}
+
+int Peer::Send(void *buf, int len) {
+	int r = (replay != nullptr) ? len : sock->Send(buf, len);
+	if (r > 0) bytes_out += r;
+	return r;
+}
+
+int Peer::SendStr(string s) {
+	int r = (replay != nullptr) ? s.length() + 1 : sock->SendStr(s);
+	if (r > 0) bytes_out += r;
+	return r;
+}
+
+int Peer::Recv(void *buf, int len) {
+	if (replay != nullptr) {
+		int r = replay->Read(buf, len);
+		if (r > 0) bytes_in += r;
+		return r;
+	}
+	int r = sock->Recv(buf, len);
+	if (r > 0) {
+		bytes_in += r;
+		capture_record(id, buf, r);
+	}
+	return r;
+}
+
+void Peer::SetTimeout(int us) {
+	if (sock != nullptr) sock->timeout = us;
+}
+
+bool Peer::CheckRead(void) {
+	if (replay != nullptr) return replay->pos < replay->avail;
+	return sock->CheckRead();
+}
+
+bool Peer::CheckWrite(void) {
+	if (replay != nullptr) return true;
+	
+	/* portsock only knows how to wait for reading, so this goes straight
+	 * to the socket.
+	 */
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(sock->fd, &fds);
+	
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	return select(sock->fd + 1, nullptr, &fds, nullptr, &tv) == 1;
+}
+
+OutMsg::OutMsg(string c, string data, int f, int n) {
+	cmd = c;
+	payload = data;
+	from = f;
+	count = n;
+	off = 0;
+	cursor = nullptr;
+	cursor_at = -1;
+}
+
+size_t OutMsg::Size(void) const {
+	return Buffered() + (size_t)count * BLOCK_RECORD_LEN;
+}
+
+size_t OutMsg::Buffered(void) const {
+	return cmd.length() + 1 + payload.length();
+}
+
+/* Adds m to the queue, at position pos */
+static int queue_msg(Peer *p, OutMsg m, size_t pos) {
+	size_t size = m.Buffered();
+	bool range = (m.count > 0);
+	if (!p->out_queue.empty() && (p->queued + size > MAX_QUEUED
+			|| (range && p->ranges >= MAX_RANGES_QUEUED))) {
+		p->dropped++;
+		return -1;
+	}
+	if (p->out_queue.empty()) {
+		p->last_progress = now_ms();
+	}
+	p->out_queue.insert(p->out_queue.begin() + pos, m);
+	p->queued += size;
+	if (range) p->ranges++;
+	return 0;
+}
+
+/* Takes the message at the front off the queue */
+static void pop_msg(Peer *p) {
+	OutMsg &m = p->out_queue.front();
+	p->queued -= m.Buffered();
+	if (m.count > 0) p->ranges--;
+	p->out_queue.pop_front();
+}
+
+int Peer::Queue(string cmd, string payload) {
+	return queue_msg(this, OutMsg(cmd, payload), out_queue.size());
+}
+
+int Peer::QueueRange(string cmd, int from, int count) {
+	OutMsg m(cmd, "", from, count);
+	if (count > 0) {
+		char hash[32];
+		if (bc->HashAt(from + count - 1, hash)) return -1;
+		m.last_hash.assign(hash, 32);
+	}
+	return queue_msg(this, m, out_queue.size());
+}
+
+int Peer::QueueFirst(string cmd) {
+	/* Can't cut into a message that's halfway out */
+	size_t pos = 0;
+	while (pos < out_queue.size() && out_queue[pos].off > 0) pos++;
+	return queue_msg(this, OutMsg(cmd), pos);
+}
+
+/* Sends as much of buf as p's socket takes right now, without waiting for
+ * it. The amount sent, 0 if it's full, or -1 on error.
+ */
+static int send_nowait(Peer *p, const char *buf, size_t len) {
+	if (p->replay != nullptr) return p->Send((void*)buf, len);
+#ifndef _WIN32
+	int flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	ssize_t r = send(p->sock->fd, buf, len, flags);
+	if (r < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	p->bytes_out += r;
+	return r;
+#else
+	if (!p->CheckWrite()) return 0;
+	return p->Send((void*)buf, (len > WAIT_WRITE_CHUNK) ? WAIT_WRITE_CHUNK : len);
+#endif
+}
+
+/* Sends some of what's left of m, at most max bytes, without waiting for
+ * the peer. The amount sent (0 if the socket is full), -1 on error, or -2
+ * if the chain changed under m's blocks before any of it went out.
+ */
+static int send_some(Peer *p, OutMsg &m, size_t max) {
+	/* Blocks from two different chains under one header would make no
+	 * sense to the peer. If none of it is out yet, it can just go, as the
+	 * peer asks again once it sees our new length. Otherwise there's no
+	 * way of telling it, so it has to go.
+	 */
+	if (m.count > 0) {
+		char hash[32];
+		if (bc->HashAt(m.from + m.count - 1, hash) || memcmp(hash, m.last_hash.data(), 32)) {
+			return (m.off == 0) ? -2 : -1;
+		}
+	}
+	
+	size_t head = m.cmd.length() + 1;
+	if (m.off < head) {
+		size_t n = head - m.off;
+		return send_nowait(p, m.cmd.c_str() + m.off, (n > max) ? max : n);
+	}
+	
+	size_t pos = m.off - head;
+	if (pos < m.payload.length()) {
+		size_t n = m.payload.length() - pos;
+		return send_nowait(p, &m.payload[pos], (n > max) ? max : n);
+	}
+	
+	/* The blocks. With a store they're right there, in the same format
+	 * as they go out in, so the kernel can copy them from the block file
+	 * to the socket itself.
+	 */
+	pos -= m.payload.length();
+	int k = pos / BLOCK_RECORD_LEN;
+	size_t in = pos % BLOCK_RECORD_LEN;
+	int n = max / BLOCK_RECORD_LEN + 1;
+	if (n > m.count - k) n = m.count - k;
+	if (bc->store != nullptr) {
+#ifndef _WIN32
+		if (p->replay == nullptr) {
+			int r = bc->store->SendTo(p->sock->fd, m.from + k, n, in, max);
+			if (r > 0) p->bytes_out += r;
+			return r;
+		}
+#endif
+		char *buf = bc->store->Range(m.from + k, n);
+		if (buf == nullptr) return -1;
+		size_t left = (size_t)n * BLOCK_RECORD_LEN - in;
+		return send_nowait(p, buf + in, (left > max) ? max : left);
+	}
+	
+	/* Without a store they're copied out of the chain. The chain hasn't
+	 * changed under them (see above), so the cursor is still good as long
+	 * as it hasn't been pruned.
+	 */
+	int h = m.from + k;
+	if (h < bc->base) return -1;
+	if (m.cursor == nullptr || m.cursor_at != h) {
+		m.cursor = bc->BlockAt(h);
+		m.cursor_at = h;
+	}
+	
+	static vector<char> buf;
+	buf.resize((size_t)n * BLOCK_RECORD_LEN);
+	Block *b = m.cursor;
+	for (int j = 0; j < n; j++, b = b->next) {
+		char *rec = &buf[(size_t)j * BLOCK_RECORD_LEN];
+		memcpy(rec, b->data, 256);
+		memcpy(rec + 256, b->nonce, 32);
+		memcpy(rec + 256 + 32, &b->time, 8);
+	}
+	size_t left = buf.size() - in;
+	int r = send_nowait(p, &buf[in], (left > max) ? max : left);
+	if (r <= 0) return r;
+	
+	/* Move the cursor up to wherever the next send starts */
+	int done = (in + r) / BLOCK_RECORD_LEN;
+	for (int j = 0; j < done && m.cursor_at + 1 < m.from + m.count; j++) {
+		m.cursor = m.cursor->next;
+		m.cursor_at++;
+	}
+	return r;
+}
+
+int Peer::Flush(size_t max_bytes) {
+	if (out_queue.empty()) return 0;
+	TRACE_SPAN("flush");
+	size_t sent = 0;
+	while (!out_queue.empty() && sent < max_bytes) {
+		OutMsg &m = out_queue.front();
+		int r = send_some(this, m, WRITE_CHUNK);
+		if (r == -2) {
+			pop_msg(this);
+			continue;
+		}
+		if (r < 0) return -1;
+		/* The socket is full, so the rest has to wait */
+		if (r == 0) break;
+		
+		m.off += r;
+		sent += r;
+		busy_bytes += r;
+		if (m.off == m.Size()) {
+			pop_msg(this);
+		}
+	}
+	if (sent > 0 || out_queue.empty()) {
+		last_progress = now_ms();
+	}
+	return 0;
 }
 
 
@@ -32,6 +362,39 @@ static Socket *listen_sock;
 
 static vector<Peer*> peer_list;
 
+/* Hashes of blocks we've accepted lately, so the same block isn't
+ * requested or relayed over and over.
+ */
+static RollingBloom seen_blocks(4096);
+
+/* Blocks we've asked a peer for with GETDATA but haven't got yet: who we
+ * asked, when (ms, 0 to ask again right away), and who else announced it
+ * that we can ask if that doesn't work out.
+ */
+class InFlight {
+public:
+	Peer *peer;
+	int64_t sent;
+	vector<Peer*> others;
+};
+static unordered_map<string, InFlight> in_flight;
+
+/* How long we wait for a block we asked for before asking someone else (ms) */
+#define IN_FLIGHT_TIMEOUT 5000
+
+/* Blocks to announce at the end of this tick, and the peer each came from
+ * (nullptr if we mined it ourselves), which doesn't need to hear about it.
+ */
+class RelayItem {
+public:
+	string hash;
+	Peer *source;
+};
+static vector<RelayItem> relay_queue;
+
+/* Most hashes in one INV or GETDATA */
+#define MAX_INV 1000
+
 /* Here are functions that are called upon recieving a certain command */
 
 static int cmd_disconnect(Peer *p, string s) {
@@ -45,6 +408,29 @@ static int cmd_disconnect(Peer *p, string s) {
 	}
 	peer_list.erase(peer_list.begin() + i);
 	
+	for (unsigned int j = 0; j < relay_queue.size(); j++) {
+		if (relay_queue[j].source == p) {
+			relay_queue[j].source = nullptr;
+		}
+	}
+	
+	/* Whatever we were waiting on from them has to come from someone
+	 * else now.
+	 */
+	for (auto &i : in_flight) {
+		InFlight &f = i.second;
+		for (unsigned int j = 0; j < f.others.size(); j++) {
+			if (f.others[j] == p) {
+				f.others.erase(f.others.begin() + j);
+				j -= 1;
+			}
+		}
+		if (f.peer == p) {
+			f.peer = nullptr;
+			f.sent = 0;
+		}
+	}
+	
 	/* Now we can safely delete the peer (which will disconnect) */
 	delete p;
 	return 0;
@@ -54,153 +440,466 @@ static int cmd_disconnect(Peer *p, string s) {
 static int cmd_ping(Peer *p, string s) {
 	if (s.compare(0, 4, "PING") != 0) return -1;
 	p->status = 1;
-	p->last_touch = time(nullptr);
 
-	if (p->sock->SendStr("PONG") <= 0) {
-		return -1;
-	}
+	p->QueueFirst("PONG");
 	return 0;
 }
 
 static int cmd_pong(Peer *p, string s) {
 	if (s.compare(0, 4, "PONG") != 0) return -1;
 	p->status = 1;
-	p->last_touch = time(nullptr);
+	
+	/* Unsolicited PONGs don't tell us anything about latency */
+	if (p->ping_sent != 0) {
+		int64_t rtt = now_ms() - p->ping_sent;
+		if (p->latency < 0) {
+			p->latency = rtt;
+		} else {
+			p->latency = (p->latency * 3 + rtt) / 4;
+		}
+		p->ping_sent = 0;
+	}
 	return 0;
 }
 
 static int cmd_getlen(Peer *p, string s) {
 	string ret = "RETLEN ";
 	ret += to_string(bc->len);
-	p->sock->SendStr(ret);
-	if (s.length() >= 8) {
+	p->Queue(ret);
+	int plen;
+	if (sscanf(s.c_str(), "GETLEN %d", &plen) == 1) {
 		/* The peer has specified their own length, check if it's higher
 		 * than ours. if so, request the peer's chain.
 		 */
-		string data = s.substr(7);
-		int plen = stoi(data);
 		if (plen > bc->len) {
-			p->sock->SendStr("GETCHAIN");
+			p->Queue("GETCHAIN");
 		}
 	}
 	return 0;
 }
 
 static int cmd_retlen(Peer *p, string s) {
-	if (s.length() < 8) return -1;
-	string i = s.substr(7);
-	if (stoi(i) > bc->len) {
+	int plen;
+	if (sscanf(s.c_str(), "RETLEN %d", &plen) != 1) return -1;
+	if (plen > bc->len) {
 		/* request their chain */ 
-		p->sock->SendStr("GETCHAIN");
+		p->Queue("GETCHAIN");
 	}
 	return 0;
 }
 
-static int send_block(Peer *p, Block *b) {
-	p->sock->Send(b->data, 256);
-	p->sock->Send(b->nonce, 32);
-	p->sock->Send(&b->time, 8);
+/* Remembers a block that was just added to our chain, to be announced to
+ * every peer but source at the end of the tick.
+ */
+static void relay_block(Block *b, Peer *source) {
+	seen_blocks.Insert(b->hash);
+	in_flight.erase(string(b->hash, 32));
+	relay_queue.push_back(RelayItem{string(b->hash, 32), source});
+}
+
+/* Announces everything in relay_queue, in one INV per peer */
+static void flush_relay(void) {
+	if (relay_queue.empty()) return;
+	
+	for (unsigned int i = 0; i < peer_list.size(); i++) {
+		string inv;
+		for (unsigned int j = 0; j < relay_queue.size(); j++) {
+			if (relay_queue[j].source != peer_list[i]) {
+				inv += relay_queue[j].hash;
+			}
+		}
+		/* Only whole batches fit in an INV */
+		for (size_t off = 0; off < inv.length(); off += MAX_INV * 32) {
+			string part = inv.substr(off, MAX_INV * 32);
+			peer_list[i]->Queue("INV " + to_string(part.length() / 32), part);
+		}
+	}
+	relay_queue.clear();
+}
+
+/* Reads the data, nonce and time of a block from p into b. 0 on success */
+static int read_block(Peer *p, Block *b) {
+	TRACE_SPAN("recv_block");
+	/* This needs a big timeout for some reason. */
+	p->SetTimeout(1000000);
+	
+	if (p->Recv(b->data, 256) != 256) return 1;
+	if (p->Recv(b->nonce, 32) != 32) return 1;
+	if (p->Recv(&b->time, 8) != 8) return 1;
 	return 0;
 }
 
-static int recv_block(Peer *p, BlockChain *nbc) {
+/* Recieves a block from p and adds it on top of *parent, then points
+ * *parent at it (or at our copy of it, if we had it already). If parent is
+ * nullptr, the block is recieved and thrown away. If is_new isn't nullptr,
+ * it's set to whether the block was new to us.
+ * 0 -> ok, 1 -> couldn't recieve, -1 -> the block is invalid
+ */
+static int recv_block(Peer *p, Block **parent, bool *is_new = nullptr) {
 	if (p == nullptr) return 1;
 	Block *b = new Block();
-	/* This needs a big timeout for some reason. */
-	p->sock->timeout = 1000000;
-	
-	if (p->sock->Recv(b->data, 256) != 256) {
+	if (read_block(p, b)) {
 		delete b;
 		return 1;
 	}
-	if (p->sock->Recv(b->nonce, 32) != 32) {
+	if (parent == nullptr) {
 		delete b;
-		return 1;
+		return 0;
 	}
-	if (p->sock->Recv(&b->time, 8) != 8) {
-		delete b;
-		return 1;
+	
+	int r = bc->AddBlock(b, *parent);
+	if (is_new != nullptr) {
+		*is_new = (r == 0);
 	}
-	if (nbc == nullptr) {
-		delete b;
+	if (r == 0) {
+		*parent = b;
 		return 0;
 	}
-	
-	if (nbc->AddBlock(b) != 0) {
-		/* Block is invalid, disconnect from peer. */
+	if (r == 1) {
+		/* Already had it */
+		*parent = bc->Find(b->hash);
 		delete b;
-		return 1;
+		return 0;
 	}
-	return 0;
+	delete b;
+	return -1;
 }	
 
+/* Recieves count blocks that go at heights from, from + 1, ... of our
+ * chain, or on top of the last page we got from p if they follow on from
+ * it. If we've pruned some of those heights, the blocks there have to
+ * match our headers. Everything after that goes into the block tree.
+ * Whatever happens, all count blocks are read.
+ * 0  -> ok
+ * 1  -> couldn't recieve
+ * -1 -> an invalid block, or the blocks don't fit on our chain
+ * -2 -> the blocks split off from our chain below what we keep
+ */
+static int recv_chain(Peer *p, int from, int count) {
+	Block *parent = nullptr;
+	auto page = p->pages.find(from);
+	if (page != p->pages.end()) {
+		parent = bc->Find((char*)page->second.data());
+		if (parent != nullptr && parent->height != from - 1) parent = nullptr;
+		p->pages.erase(page);
+	}
+	
+	int ret = 0;
+	if (parent == nullptr) {
+		if (from > bc->len) {
+			ret = -1;
+		} else if (from > bc->base) {
+			parent = bc->BlockAt(from - 1);
+		}
+	}
+	
+	for (int j = 0; j < count; j++) {
+		int h = from + j;
+		if (ret != 0) {
+			/* Just skip the rest */
+			if (recv_block(p, nullptr)) return 1;
+		} else if (h < bc->base) {
+			Block b;
+			if (read_block(p, &b)) return 1;
+			if (bc->MatchesHeader(&b, h)) ret = -2;
+		} else {
+			bool is_new;
+			int r = recv_block(p, &parent, &is_new);
+			if (r == 1) return 1;
+			if (r == 0 && is_new) {
+				relay_block(parent, p);
+			}
+			ret = r;
+		}
+	}
+	
+	if (ret == 0 && parent != nullptr && count > 0) {
+		p->pages[from + count] = string(parent->hash, 32);
+		if (p->pages.size() > MAX_PAGES) p->pages.erase(p->pages.begin());
+	}
+	return ret;
+}
+
+/* RETCHAIN <length> <count> is followed by the first count blocks of our
+ * chain. The peer gets the rest with GETRANGE, MAX_RANGE blocks at a time.
+ */
 static int cmd_getchain(Peer *p, string s) {
 	if (s != "GETCHAIN") return 1;
 	
+	/* The blocks are read from the chain as they go out, so they don't
+	 * take up room in the queue.
+	 */
+	int count = (bc->len > MAX_RANGE) ? MAX_RANGE : bc->len;
 	string ret = "RETCHAIN ";
-	ret += to_string(bc->len);
-	p->sock->SendStr(ret);
+	ret += to_string(bc->len) + " " + to_string(count);
+	p->QueueRange(ret, 0, count);
+	return 0;
+}
+
+/* GETRANGE <from> <count> asks for count blocks starting at height from.
+ * We send at most MAX_RANGE of them.
+ */
+static int cmd_getrange(Peer *p, string s) {
+	int from, count;
+	if (sscanf(s.c_str(), "GETRANGE %d %d", &from, &count) != 2) return -1;
+	if (from < 0 || count < 0) return -1;
 	
-	Block *i = bc->first_block;
-	
-	while (i != nullptr) {
-		send_block(p, i);
-		i = i->next;
-	}
+	if (from > bc->len) from = bc->len;
+	if (count > bc->len - from) count = bc->len - from;
+	if (count > MAX_RANGE) count = MAX_RANGE;
 	
+	string ret = "RETRANGE ";
+	ret += to_string(from) + " " + to_string(count);
+	p->QueueRange(ret, from, count);
 	return 0;
 }
 
 static int cmd_retchain(Peer *p, string s) {
-	if (s.length() < 10) return -1;
-	
-	BlockChain *nbc = new BlockChain();
-	nbc->data_list.clear();
-		
-	int block_count = stoi(s.substr(9));
-	if (block_count < bc->len) return 1;
+	/* Peers that send the whole chain at once leave out the count */
+	int total, block_count;
+	int n = sscanf(s.c_str(), "RETCHAIN %d %d", &total, &block_count);
+	if (n < 1) return -1;
+	if (n == 1) block_count = total;
+	if (block_count < 0 || block_count > total) return -1;
 	
-	for (int j = 0; j < block_count; j++) {
-		if (recv_block(p, nbc)) {
-			delete nbc;
-			return 1;
+	/* A shorter chain can't have more work than ours, so don't bother
+	 * keeping it.
+	 */
+	if (total < bc->len) {
+		for (int j = 0; j < block_count; j++) {
+			if (recv_block(p, nullptr)) return 1;
 		}
+		return 0;
+	}
+	
+	/* Everything goes into the block tree. Whatever we already have is
+	 * skipped, and the chain switches over on its own once the new branch
+	 * has more work than ours. A chain that split off from ours before
+	 * the part we've pruned can't be switched to, so it's ignored.
+	 */
+	int r = recv_chain(p, 0, block_count);
+	if (r == 1 || r == -1) {
+		return 1;
+	}
+	if (r == 0 && block_count < total) {
+		p->Queue("GETRANGE " + to_string(block_count) + " " + to_string(MAX_RANGE));
 	}
-	/* If we reach here, the new chain must be completely valid *and*
-	 * longer than our current one.
+	return 0;
+}
+
+static int cmd_retrange(Peer *p, string s) {
+	int from, count;
+	if (sscanf(s.c_str(), "RETRANGE %d %d", &from, &count) != 2) return -1;
+	if (from < 0 || count < 0) return -1;
+	
+	/* The blocks go on top of the block before from in our chain. If that
+	 * doesn't work out, the peer is on a fork and we need all of it.
 	 */
-	delete bc;
-	bc = nbc;
+	int r = recv_chain(p, from, count);
+	if (r == 1) return 1;
+	if (r == -1) {
+		p->Queue("GETCHAIN");
+	}
+	
+	/* A full page means there might be more */
+	if (r == 0 && count == MAX_RANGE) {
+		p->Queue("GETRANGE " + to_string(from + count) + " " + to_string(MAX_RANGE));
+	}
 	return 0;
 }
 
 static int cmd_newblock(Peer *p, string s) {
 	/* Error if there's no argument */
-	if (s.length() < 10) return -1;
+	int index;
+	if (sscanf(s.c_str(), "NEWBLOCK %d", &index) != 1) return -1;
 	
-	int index = stoi(s.substr(9));
+	/* If the new block is way outside of our chain, request the blocks
+	 * we're missing from the peer that found the new block.
+	 */
+	if (index > (bc->len)) {
+		if (recv_block(p, nullptr)) return 1;
+		string req = "GETRANGE ";
+		req += to_string(bc->len) + " " + to_string(index - bc->len + 1);
+		p->Queue(req);
+		return 0;
+	}
 	
-	/* If our chain is already longer than theirs, ignore it. */
-	if (index <= (bc->len - 1)) {
-		recv_block(p, nullptr);
+	/* Competing with a block we've pruned, too late for that. */
+	if (index < bc->base) {
+		return recv_block(p, nullptr);
+	}
+	
+	/* Otherwise, it either extends our chain or competes with one of its
+	 * blocks. Either way it goes into the block tree, on top of the block
+	 * before it in our chain.
+	 */
+	Block *parent = (index > bc->base) ? bc->BlockAt(index - 1) : nullptr;
+	bool is_new;
+	int r = recv_block(p, &parent, &is_new);
+	if (r == -1) {
+		/* Doesn't fit on our chain, so the peer must be on a fork. */
+		p->Queue("GETCHAIN");
 		return 0;
 	}
+	if (r == 0 && is_new) {
+		relay_block(parent, p);
+	}
+	return r;
+}
+
+/* LOOKUP <data>: is this data in a block of the chain? */
+static int cmd_lookup(Peer *p, string s) {
+	if (s.length() < 8) return -1;
+	string data = s.substr(7);
 	
-	/* If the new block is exactly at the end of our chain, recieve it. */
-	if (index == (bc->len)) {
-		return recv_block(p, bc);
+	PayloadEntry e;
+	if (bc->Lookup((char*)data.c_str(), data.length(), &e)) {
+		p->Queue("NOTFOUND " + data);
+		return 0;
 	}
+	string ret = "FOUND ";
+	ret += to_string(e.height) + " " + hex_hash(e.hash) + " " + data;
+	p->Queue(ret);
+	return 0;
+}
+
+/* Answers to a LOOKUP. Those mostly go to clients rather than nodes, but
+ * if we do get one, just show it.
+ */
+static int cmd_found(Peer *p, string s) {
+	(void)p;
+	cout << "Peer says: " << s << endl;
+	return 0;
+}
+
+/* Reads the count and list of hashes that come with INV and GETDATA. fmt
+ * is how the count is written in s, e.g. "INV %d".
+ */
+static int recv_hashes(Peer *p, string s, const char *fmt, string *hashes) {
+	int n;
+	if (sscanf(s.c_str(), fmt, &n) != 1) return -1;
+	if (n <= 0 || n > MAX_INV) return -1;
 	
-	/* If the new block is way outside of our chain, request the entire
-	 * chain of the peer that found the new block.
+	hashes->resize(n * 32);
+	p->SetTimeout(1000000);
+	if (p->Recv(&(*hashes)[0], n * 32) != n * 32) return -1;
+	return n;
+}
+
+/* INV <n>, followed by n block hashes: the peer has these blocks */
+static int cmd_inv(Peer *p, string s) {
+	string hashes;
+	int n = recv_hashes(p, s, "INV %d", &hashes);
+	if (n < 0) return -1;
+	
+	/* Ask for the ones we haven't seen yet. If someone else is already
+	 * sending one, this peer is kept in mind in case they don't come
+	 * through.
 	 */
-	if (index > (bc->len)) {
-		recv_block(p, nullptr);
-		p->sock->SendStr("GETCHAIN");
+	string want;
+	for (int i = 0; i < n; i++) {
+		char *h = &hashes[i * 32];
+		if (seen_blocks.Contains(h) || bc->Find(h) != nullptr) continue;
+		
+		auto f = in_flight.find(string(h, 32));
+		if (f != in_flight.end()) {
+			f->second.others.push_back(p);
+			continue;
+		}
+		in_flight[string(h, 32)] = InFlight{p, now_ms(), {}};
+		want.append(h, 32);
+	}
+	if (want.empty()) return 0;
+	
+	string req = "GETDATA ";
+	req += to_string(want.length() / 32);
+	p->Queue(req, want);
+	return 0;
+}
+
+/* GETDATA <n>, followed by n block hashes: send these as BLOCK messages */
+static int cmd_getdata(Peer *p, string s) {
+	string hashes;
+	int n = recv_hashes(p, s, "GETDATA %d", &hashes);
+	if (n < 0) return -1;
+	
+	for (int i = 0; i < n; i++) {
+		Block *b = bc->Find(&hashes[i * 32]);
+		if (b == nullptr) continue;
+		
+		string block(b->prev_hash, 32);
+		block.append(b->data, 256);
+		block.append(b->nonce, 32);
+		block.append((char*)&b->time, 8);
+		p->Queue("BLOCK", block);
+	}
+	return 0;
+}
+
+/* BLOCK, followed by the hash of the block before it and the block */
+static int cmd_block(Peer *p, string s) {
+	if (s != "BLOCK") return -1;
+	
+	char prev[32];
+	p->SetTimeout(1000000);
+	if (p->Recv(prev, 32) != 32) return 1;
+	
+	Block *parent;
+	if (bc->FindParent(prev, &parent)) {
+		/* We're missing the blocks before it (or pruned them), so sync
+		 * up. Asking anyone else for it won't help either.
+		 */
+		Block b;
+		if (read_block(p, &b)) return 1;
+		memcpy(b.prev_hash, prev, 32);
+		b.CalculateHash();
+		in_flight.erase(string(b.hash, 32));
+		
+		string req = "GETLEN ";
+		req += to_string(bc->len);
+		p->Queue(req);
+		return 0;
+	}
+	
+	bool is_new;
+	int r = recv_block(p, &parent, &is_new);
+	if (r != 0) {
+		/* We know exactly where this goes, so an invalid block means the
+		 * peer is misbehaving.
+		 */
+		return 1;
+	}
+	if (is_new) {
+		relay_block(parent, p);
+	} else {
+		in_flight.erase(string(parent->hash, 32));
 	}
 	return 0;
 }
 
+/* Asks someone else for blocks that the peer we asked hasn't sent in time
+ * (or has gone away). Blocks nobody else has announced are forgotten, so
+ * the next INV for them asks again.
+ */
+static void retry_in_flight(int64_t now) {
+	for (auto i = in_flight.begin(); i != in_flight.end(); ) {
+		InFlight &f = i->second;
+		if (f.sent != 0 && now - f.sent <= IN_FLIGHT_TIMEOUT) {
+			i++;
+			continue;
+		}
+		if (f.others.empty()) {
+			i = in_flight.erase(i);
+			continue;
+		}
+		f.peer = f.others.front();
+		f.others.erase(f.others.begin());
+		f.sent = now;
+		f.peer->Queue("GETDATA 1", i->first);
+		i++;
+	}
+}
+
 static string commands[] = {
 	"DISCONNECT",
 	/* We use these for routine checks to see if a peer is still alive */
@@ -219,8 +918,29 @@ static string commands[] = {
 	"GETCHAIN",
 	"RETCHAIN",
 	
+	/* GETRANGE requests some of a peer's blocks by height
+	 * RETRANGE returns them to a peer who sent GETRANGE
+	 */
+	"GETRANGE",
+	"RETRANGE",
+	
 	/* Announce a new block */
-	"NEWBLOCK"
+	"NEWBLOCK",
+	
+	/* INV announces blocks by hash
+	 * GETDATA asks for some of the blocks announced by INV
+	 * BLOCK sends one of them, along with the hash of its parent
+	 */
+	"INV",
+	"GETDATA",
+	"BLOCK",
+	
+	/* LOOKUP asks whether some data is in the chain
+	 * FOUND (height, block hash and data) or NOTFOUND (data) answers it
+	 */
+	"LOOKUP",
+	"FOUND",
+	"NOTFOUND"
 };
 
 /* Actions to be called in response to the commands above */
@@ -232,16 +952,43 @@ static int (*command_actions[])(Peer *p, string s) = {
 	cmd_retlen,
 	cmd_getchain,
 	cmd_retchain,
-	cmd_newblock
+	cmd_getrange,
+	cmd_retrange,
+	cmd_newblock,
+	cmd_inv,
+	cmd_getdata,
+	cmd_block,
+	cmd_lookup,
+	cmd_found,
+	cmd_found
 };
 
+#define COMMAND_COUNT (int)(sizeof(commands)/sizeof(string))
+
+/* How many times each command was handled, and how long that took (ns) */
+class CmdStats {
+public:
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+};
+static CmdStats cmd_stats[COMMAND_COUNT];
+
 /* Handle incoming command s from peer p */
 static int handle_cmd(Peer *p, string s) {
 	/* Find the command, and call the corresponding action */
-	for (int i = 0; i < (int)(sizeof(commands)/sizeof(string)); i++) {
+	for (int i = 0; i < COMMAND_COUNT; i++) {
 		if (s.compare(0, commands[i].length(), commands[i]) == 0) {
 			if (i == 0) return 1;
-			return command_actions[i](p, s);
+			TraceSpan span(commands[i].c_str());
+			auto start = chrono::steady_clock::now();
+			int r = command_actions[i](p, s);
+			uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+			
+			cmd_stats[i].count++;
+			cmd_stats[i].total += ns;
+			if (ns > cmd_stats[i].max) cmd_stats[i].max = ns;
+			return r;
 		}
 	}
 	return -1;
@@ -249,8 +996,8 @@ static int handle_cmd(Peer *p, string s) {
 
 /* Check if this specific peer has sent any commands to us */
 static int handle_peer(Peer *p) {
-	p->sock->timeout = 100;
-	if (p->sock->CheckRead() == false) return 0;
+	p->SetTimeout(NET_POLL_TIMEOUT);
+	if (p->CheckRead() == false) return 0;
 	
 	string s;
 	
@@ -259,7 +1006,7 @@ static int handle_peer(Peer *p) {
 	 */
 	char c;
 	while (1) {
-		if (p->sock->Recv(&c, 1) <= 0) {
+		if (p->Recv(&c, 1) <= 0) {
 			/* Error reading, or no data. Either way, we gotta disconnect. */
 			cmd_disconnect(p, "DISCONNECT");
 			return 1;
@@ -270,6 +1017,7 @@ static int handle_peer(Peer *p) {
 	}
 	
 	/* Got a command. */
+	p->last_touch = now_ms();
 	if (handle_cmd(p, s)) {
 		cmd_disconnect(p, "DISCONNECT");
 		return 1;
@@ -277,15 +1025,94 @@ static int handle_peer(Peer *p) {
 	return 0;
 }
 
+/* Tells p we're going, if that can be done without waiting on it and
+ * without cutting into a message that's halfway out.
+ */
+static void say_goodbye(Peer *p) {
+	if (!p->out_queue.empty() && p->out_queue.front().off > 0) return;
+	if (p->CheckWrite()) p->SendStr(commands[0]);
+}
+
+/* Disconnects from a peer we don't want anymore */
+static void evict_peer(Peer *p, const char *why) {
+	cout << "Dropping peer: " << why << endl;
+	say_goodbye(p);
+	cmd_disconnect(p, "DISCONNECT");
+}
+
+/* Keeps an eye on peer p: PINGs it every now and then, and drops it if
+ * it's dead, too slow, or can't keep up with what we send it.
+ * 1 if the peer was dropped.
+ */
+static int check_peer(Peer *p, int64_t now) {
+	if (now - p->last_touch > PEER_TIMEOUT) {
+		evict_peer(p, "timed out");
+		return 1;
+	}
+	if (p->ping_sent != 0 && now - p->ping_sent > PING_TIMEOUT) {
+		evict_peer(p, "no PONG");
+		return 1;
+	}
+	if (p->latency > MAX_LATENCY) {
+		evict_peer(p, "too slow");
+		return 1;
+	}
+	if (!p->out_queue.empty() && now - p->last_progress > STALL_TIMEOUT) {
+		evict_peer(p, "stalled");
+		return 1;
+	}
+	if (!p->out_queue.empty() && p->throughput >= 0 && p->throughput < MIN_THROUGHPUT) {
+		evict_peer(p, "can't keep up");
+		return 1;
+	}
+	
+	if (p->ping_sent == 0 && now - p->last_ping > PING_INTERVAL) {
+		if (p->QueueFirst("PING") == 0) {
+			p->ping_sent = now;
+			p->last_ping = now;
+		}
+	}
+	
+	/* Send whatever's waiting. A peer that fails here is gone anyway. */
+	if (p->Flush(FLUSH_BUDGET)) {
+		cmd_disconnect(p, "DISCONNECT");
+		return 1;
+	}
+	
+	/* A peer with nothing waiting for it could be as slow as it likes
+	 * without us noticing, so throughput only counts while there's a
+	 * backlog.
+	 */
+	if (p->out_queue.empty()) {
+		p->busy_since = 0;
+	} else if (p->busy_since == 0) {
+		p->busy_since = now;
+		p->busy_bytes = 0;
+	} else if (now - p->busy_since >= THROUGHPUT_WINDOW) {
+		int64_t rate = p->busy_bytes * 1000 / (now - p->busy_since);
+		p->throughput = (p->throughput < 0) ? rate : (p->throughput * 3 + rate) / 4;
+		p->busy_since = now;
+		p->busy_bytes = 0;
+	}
+	return 0;
+}
+
 int handle_network(void) {
 	/* Check if there's any incoming connections */
 	Socket *ns = listen_sock->Accept();
 	while (ns != nullptr) {
-		/* Add new peer based on the incoming connection */
-		Peer *np = new Peer(ns);
-		peer_list.push_back(np);
-		ns->SendStr("PING");
-		cout << "Got a connection? " << endl;
+		if (peer_list.size() >= MAX_PEERS) {
+			/* No room, turn them away. */
+			ns->SendStr(commands[0]);
+			delete ns;
+		} else {
+			/* Add new peer based on the incoming connection */
+			Peer *np = new Peer(ns);
+			peer_list.push_back(np);
+			np->ping_sent = np->last_ping = now_ms();
+			np->QueueFirst("PING");
+			cout << "Got a connection? " << endl;
+		}
 		/* Keep accepting until there's no more incoming connections */
 		ns = listen_sock->Accept();
 	}
@@ -300,9 +1127,32 @@ int handle_network(void) {
 			i -= 1;
 		}
 	}
+	
+	/* Announce this tick's new blocks, then send what's queued */
+	flush_relay();
+	
+	int64_t now = now_ms();
+	retry_in_flight(now);
+	for (unsigned int i = 0; i < peer_list.size(); i++) {
+		if (check_peer(peer_list[i], now)) {
+			i -= 1;
+		}
+	}
 	return 0;
 } 
 
+int network_pending(void) {
+	if (listen_sock != nullptr) {
+		listen_sock->timeout = NET_POLL_TIMEOUT;
+		if (listen_sock->CheckRead()) return 1;
+	}
+	for (unsigned int i = 0; i < peer_list.size(); i++) {
+		peer_list[i]->SetTimeout(NET_POLL_TIMEOUT);
+		if (peer_list[i]->CheckRead()) return 1;
+	}
+	return 0;
+}
+
 int add_peer(string IP, int port) {
 	Socket *ns = new Socket();
 	
@@ -317,16 +1167,9 @@ int add_peer(string IP, int port) {
 }
 
 int announce_last_block(void) {
-	string cmd = "NEWBLOCK ";
-	cmd += to_string(bc->len - 1);
-	
-	for (unsigned int i = 0; i < peer_list.size(); i++) {
-		if (peer_list[i]->sock->SendStr(cmd) <= 0)
-			return 1;
-		if (send_block(peer_list[i], bc->last_block))
-			return 1;
-	}
-	
+	/* Goes out as an INV with everything else at the end of the tick */
+	if (bc->last_block == nullptr) return 1;
+	relay_block(bc->last_block, nullptr);
 	return 0;
 }
 
@@ -342,10 +1185,97 @@ int network_sync(void) {
 	string cmd = "GETLEN ";
 	cmd += to_string(bc->len);
 	for (unsigned int i = 0; i < peer_list.size(); i++) {
-		if (peer_list[i]->sock->SendStr(cmd) <= 0) {
-			cout << "ERROR on " << i << endl;
-			return -1;
+		peer_list[i]->Queue(cmd);
+	}
+	return 0;
+}
+
+void print_peers(void) {
+	int64_t now = now_ms();
+	for (unsigned int i = 0; i < peer_list.size(); i++) {
+		Peer *p = peer_list[i];
+		cout << "Peer " << i << ": latency ";
+		if (p->latency < 0) {
+			cout << "unknown";
+		} else {
+			cout << p->latency << "ms";
 		}
+		cout << ", throughput ";
+		if (p->throughput < 0) {
+			cout << "unknown";
+		} else {
+			cout << p->throughput << "B/s";
+		}
+		cout << ", in " << p->bytes_in << "B, out " << p->bytes_out << "B";
+		cout << ", queued " << p->queued << "B (" << p->dropped << " dropped)";
+		cout << ", last heard from " << (now - p->last_touch) << "ms ago\n";
+	}
+	cout << peer_list.size() << " peer(s)" << endl;
+}
+
+uint64_t print_cmd_stats(void) {
+	uint64_t count = 0;
+	for (int i = 1; i < COMMAND_COUNT; i++) {
+		CmdStats &st = cmd_stats[i];
+		if (st.count == 0) continue;
+		count += st.count;
+		cout << commands[i] << ": " << st.count << " handled, ";
+		cout << (st.total / st.count / 1000) << "us avg, " << (st.max / 1000) << "us max\n";
+	}
+	cout << count << " command(s) handled" << endl;
+	return count;
+}
+
+static bool peer_alive(Peer *p) {
+	for (unsigned int i = 0; i < peer_list.size(); i++) {
+		if (peer_list[i] == p) return true;
+	}
+	return false;
+}
+
+int replay_network(vector<CaptureRecord> &records, bool fast) {
+	/* Every captured peer gets everything it ever sent up front. Records
+	 * only say how much of it has "arrived" by the time they're played,
+	 * although a handler can read further ahead, just like it would wait
+	 * on a real socket.
+	 */
+	map<uint32_t, Peer*> peers;
+	vector<size_t> ends(records.size());
+	for (size_t i = 0; i < records.size(); i++) {
+		Peer *&p = peers[records[i].peer];
+		if (p == nullptr) {
+			p = new Peer(nullptr);
+			p->replay = new ReplayStream();
+			peer_list.push_back(p);
+		}
+		p->replay->data += records[i].data;
+		ends[i] = p->replay->data.length();
+	}
+	
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < records.size(); i++) {
+		if (!fast) {
+			this_thread::sleep_until(start + chrono::microseconds(records[i].time - records[0].time));
+		}
+		
+		/* The peer might have sent DISCONNECT, or been dropped */
+		Peer *p = peers[records[i].peer];
+		if (!peer_alive(p)) continue;
+		
+		if (p->replay->avail < ends[i]) p->replay->avail = ends[i];
+		while (p->CheckRead()) {
+			if (handle_peer(p)) break;
+		}
+		
+		flush_relay();
+		for (unsigned int j = 0; j < peer_list.size(); j++) {
+			peer_list[j]->Flush(FLUSH_BUDGET);
+		}
+	}
+	
+	for (auto &i : peers) {
+		if (!peer_alive(i.second)) continue;
+		cmd_disconnect(i.second, "DISCONNECT");
 	}
 	return 0;
 }
@@ -362,7 +1292,7 @@ int init_network(string IP, int port) {
 		listen_sock = nullptr;
 		return -1;
 	}
-	listen_sock->timeout = 100;
+	listen_sock->timeout = NET_POLL_TIMEOUT;
 	
 	return 0;
 }
@@ -372,7 +1302,7 @@ int network_cleanup(void) {
 	listen_sock = nullptr;
 	
 	for (unsigned int i = 0; i < peer_list.size(); i++) {
-		peer_list[i]->sock->SendStr(commands[0]);
+		say_goodbye(peer_list[i]);
 		delete peer_list[i];
 	}
 	peer_list.clear();
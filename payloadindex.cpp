@@ -0,0 +1,88 @@
+/* Standard libraries */
+#include <stdint.h>
+
+/* Custom headers */
+#include <payloadindex.hpp>
+
+using namespace std;
+
+#define PAYLOAD_INDEX_MIN_SLOTS 1024
+
+PayloadIndex::PayloadIndex() {
+	Clear();
+}
+
+void PayloadIndex::Clear(void) {
+	keys.assign(PAYLOAD_INDEX_MIN_SLOTS, 0);
+	heights.assign(PAYLOAD_INDEX_MIN_SLOTS, -1);
+	count = 0;
+}
+
+/* Keys are sha256 output already, so they're spread out well enough to
+ * use as they are.
+ */
+size_t PayloadIndex::Home(uint64_t key) {
+	return key & (keys.size() - 1);
+}
+
+void PayloadIndex::Grow(void) {
+	vector<uint64_t> old_keys;
+	vector<int32_t> old_heights;
+	old_keys.swap(keys);
+	old_heights.swap(heights);
+	
+	keys.assign(old_keys.size() * 2, 0);
+	heights.assign(old_heights.size() * 2, -1);
+	count = 0;
+	for (size_t i = 0; i < old_keys.size(); i++) {
+		if (old_heights[i] >= 0) Insert(old_keys[i], old_heights[i]);
+	}
+}
+
+void PayloadIndex::Insert(uint64_t key, int height) {
+	if ((count + 1) * 2 > keys.size()) Grow();
+	
+	size_t mask = keys.size() - 1;
+	size_t i = Home(key);
+	while (heights[i] >= 0) i = (i + 1) & mask;
+	keys[i] = key;
+	heights[i] = height;
+	count++;
+}
+
+void PayloadIndex::Erase(uint64_t key, int height) {
+	size_t mask = keys.size() - 1;
+	size_t i = Home(key);
+	while (heights[i] >= 0 && (keys[i] != key || heights[i] != height)) {
+		i = (i + 1) & mask;
+	}
+	if (heights[i] < 0) return;
+	
+	/* Entries after the hole that were pushed past it on the way to their
+	 * own slot move back into it, or they couldn't be found anymore.
+	 */
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (heights[j] < 0) break;
+		size_t home = Home(keys[j]);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			keys[i] = keys[j];
+			heights[i] = heights[j];
+			i = j;
+		}
+	}
+	heights[i] = -1;
+	count--;
+}
+
+int PayloadIndex::Next(uint64_t key, size_t *pos) {
+	size_t mask = keys.size() - 1;
+	while (*pos < keys.size()) {
+		size_t i = (Home(key) + *pos) & mask;
+		if (heights[i] < 0) break;
+		(*pos)++;
+		if (keys[i] == key) return heights[i];
+	}
+	return -1;
+}
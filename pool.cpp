@@ -0,0 +1,388 @@
+/* Standard libraries */
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+/* Custom headers */
+#include <blockchain.hpp>
+#include <hash.hpp>
+#include <pool.hpp>
+#include <trace.hpp>
+#include <socket.hpp>
+
+using namespace std;
+using namespace portsock;
+
+extern BlockChain *bc;
+
+/* Most workers we'll hand out jobs to at once */
+#define MAX_WORKERS 64
+/* How many nonces a worker gets at a time. It asks for more with DONE once
+ * it's gone through them.
+ */
+#define POOL_RANGE ((uint64_t)1 << 24)
+/* How long we wait for a worker when just checking if it sent anything (us) */
+#define POOL_POLL_TIMEOUT 1
+/* How long a worker waits for a job when it has none (us) */
+#define WORKER_IDLE_WAIT 100000
+/* How many hashes a worker tries between checking for a new job */
+#define WORKER_CHECK_EVERY 4096
+
+/* Where the nonce starts in what gets hashed (see Block::GetHashInput) */
+#define NONCE_OFFSET 288
+
+class Worker {
+public:
+	Socket *sock;
+
+	/* The job this worker was last sent, -1 if none */
+	int job;
+
+	/* How many ranges it was given, and how many blocks it found */
+	uint64_t ranges;
+	uint64_t found;
+};
+
+static Socket *pool_sock;
+static vector<Worker*> workers;
+
+/* The job everyone should be working on right now. Only data, time,
+ * prev_hash and the last 24 bytes of the nonce mean anything.
+ */
+static Block job;
+static bool have_job = false;
+static int job_id = 0;
+static uint64_t next_start = 0;
+
+/* Solutions that made it into the chain, came in for an old job, or were
+ * just wrong.
+ */
+static uint64_t solved = 0;
+static uint64_t stale = 0;
+static uint64_t rejected = 0;
+
+static mt19937_64 rng(random_device{}());
+
+/* Recieves a NUL-terminated string. 0 on success */
+static int recv_str(Socket *s, string *out) {
+	char c;
+	while (1) {
+		if (s->Recv(&c, 1) <= 0) return -1;
+		if (c == '\0') return 0;
+		*out += c;
+	}
+}
+
+/* Sends w the current job, with the next range of nonces to go through */
+static int send_job(Worker *w) {
+	char buf[BLOCK_MSG_LEN];
+	job.GetHashInput(buf);
+
+	string cmd = "JOB " + to_string(job_id) + " " + to_string(bc->Target());
+	cmd += " " + to_string(next_start) + " " + to_string(POOL_RANGE);
+	if (w->sock->SendStr(cmd) <= 0) return -1;
+	if (w->sock->Send(buf, BLOCK_MSG_LEN) != BLOCK_MSG_LEN) return -1;
+
+	next_start += POOL_RANGE;
+	w->job = job_id;
+	w->ranges++;
+	return 0;
+}
+
+static void drop_worker(Worker *w) {
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		if (workers[i] == w) {
+			workers.erase(workers.begin() + i);
+			break;
+		}
+	}
+	delete w->sock;
+	delete w;
+	cout << "A worker left the pool" << endl;
+}
+
+/* SOLVED <job id>, followed by the whole 32-byte nonce */
+static int cmd_solved(Worker *w, string s) {
+	char nonce[32];
+	w->sock->timeout = 1000000;
+	if (w->sock->Recv(nonce, 32) != 32) return -1;
+
+	int id = -1;
+	sscanf(s.c_str(), "SOLVED %d", &id);
+	if (!have_job || id != job_id) {
+		/* Someone beat them to it. The new job is already on its way. */
+		stale++;
+		return 0;
+	}
+
+	Block *b = new Block();
+	memcpy(b->data, job.data, sizeof(b->data));
+	memcpy(b->nonce, nonce, sizeof(b->nonce));
+	b->time = job.time;
+
+	/* The block goes on whatever the job was built on, even if that's
+	 * not the tip anymore. AddBlock checks the hash itself, so a bad
+	 * worker can't get anything past us.
+	 */
+	Block *parent;
+	if (bc->FindParent(job.prev_hash, &parent)) {
+		delete b;
+		stale++;
+		return 0;
+	}
+	if (bc->AddBlock(b, parent) == 0) {
+		w->found++;
+		solved++;
+		/* Anything else that came in for this job is stale now */
+		pool_update();
+		return 1;
+	}
+	delete b;
+	rejected++;
+
+	/* Give them something else to do */
+	return send_job(w) ? -1 : 0;
+}
+
+/* DONE <job id>: the worker went through its whole range */
+static int cmd_done(Worker *w, string s) {
+	int id = -1;
+	sscanf(s.c_str(), "DONE %d", &id);
+	if (!have_job || id != job_id) return 0;
+	return send_job(w) ? -1 : 0;
+}
+
+static int cmd_leave(Worker *w, string s) {
+	(void)w;
+	(void)s;
+	return -1;
+}
+
+static string commands[] = {
+	"DISCONNECT",
+	"SOLVED",
+	"DONE"
+};
+
+static int (*command_actions[])(Worker *w, string s) = {
+	cmd_leave,
+	cmd_solved,
+	cmd_done
+};
+
+/* Handles whatever w has sent. 1 if it found a block, -1 if it's gone. */
+static int handle_worker(Worker *w) {
+	w->sock->timeout = POOL_POLL_TIMEOUT;
+	if (w->sock->CheckRead() == false) return 0;
+
+	string s;
+	if (recv_str(w->sock, &s)) return -1;
+	for (int i = 0; i < (int)(sizeof(commands)/sizeof(string)); i++) {
+		if (s.compare(0, commands[i].length(), commands[i]) == 0) {
+			TraceSpan span(commands[i].c_str());
+			return command_actions[i](w, s);
+		}
+	}
+	return -1;
+}
+
+int init_pool(string IP, int port) {
+	if (port <= 0) return -1;
+	pool_sock = new Socket();
+	if (pool_sock->Listen(IP, port)) {
+		delete pool_sock;
+		pool_sock = nullptr;
+		return -1;
+	}
+	pool_sock->timeout = POOL_POLL_TIMEOUT;
+	return 0;
+}
+
+int pool_update(void) {
+	if (pool_sock == nullptr) return 0;
+
+	Block next;
+	if (bc->NextBlock(&next)) {
+		/* Nothing to mine, so tell everyone to stop */
+		if (have_job) {
+			have_job = false;
+			for (unsigned int i = 0; i < workers.size(); i++) {
+				workers[i]->sock->SendStr("WAIT");
+				workers[i]->job = -1;
+			}
+		}
+		return 0;
+	}
+	if (have_job && memcmp(next.prev_hash, job.prev_hash, 32) == 0
+			&& memcmp(next.data, job.data, sizeof(job.data)) == 0) {
+		return 0;
+	}
+
+	/* The tip or the data changed, so whatever the workers are on is
+	 * useless now. Every job gets a fresh random nonce to count in, so
+	 * ranges from different jobs can't overlap.
+	 */
+	TRACE_SPAN("pool_update");
+	memcpy(job.data, next.data, sizeof(job.data));
+	memcpy(job.prev_hash, next.prev_hash, 32);
+	job.time = next.time;
+	for (int i = 0; i < 32; i++) {
+		job.nonce[i] = (i < 8) ? 0 : (char)rng();
+	}
+	job_id++;
+	next_start = 0;
+	have_job = true;
+
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		if (send_job(workers[i])) {
+			drop_worker(workers[i]);
+			i -= 1;
+		}
+	}
+	return 0;
+}
+
+int handle_pool(void) {
+	if (pool_sock == nullptr) return 0;
+	
+	/* A peer might have moved the tip since the last job went out, in
+	 * which case solutions for that job are stale, not wrong.
+	 */
+	pool_update();
+
+	Socket *ns = pool_sock->Accept();
+	while (ns != nullptr) {
+		if (workers.size() >= MAX_WORKERS) {
+			ns->SendStr(commands[0]);
+			delete ns;
+		} else {
+			Worker *w = new Worker{ns, -1, 0, 0};
+			workers.push_back(w);
+			cout << "A worker joined the pool" << endl;
+			if (have_job && send_job(w)) {
+				drop_worker(w);
+			}
+		}
+		ns = pool_sock->Accept();
+	}
+
+	int mined = 0;
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		int r = handle_worker(workers[i]);
+		if (r < 0) {
+			drop_worker(workers[i]);
+			i -= 1;
+		} else if (r > 0) {
+			mined = 1;
+		}
+	}
+
+	return mined;
+}
+
+int pool_pending(void) {
+	if (pool_sock == nullptr) return 0;
+	pool_sock->timeout = POOL_POLL_TIMEOUT;
+	if (pool_sock->CheckRead()) return 1;
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		workers[i]->sock->timeout = POOL_POLL_TIMEOUT;
+		if (workers[i]->sock->CheckRead()) return 1;
+	}
+	return 0;
+}
+
+void print_pool(void) {
+	if (pool_sock == nullptr) {
+		cout << "Not running a pool" << endl;
+		return;
+	}
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		Worker *w = workers[i];
+		cout << "Worker " << i << ": job " << w->job << ", " << w->ranges << " range(s), ";
+		cout << w->found << " block(s) found\n";
+	}
+	cout << workers.size() << " worker(s), job " << job_id << (have_job ? "" : " (idle)");
+	cout << ", " << solved << " solved, " << stale << " stale, " << rejected << " rejected" << endl;
+}
+
+int pool_cleanup(void) {
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		workers[i]->sock->SendStr(commands[0]);
+		delete workers[i]->sock;
+		delete workers[i];
+	}
+	workers.clear();
+	delete pool_sock;
+	pool_sock = nullptr;
+	return 0;
+}
+
+/* Worker side. A worker only ever has one job: a new one replaces the old
+ * one, and WAIT drops it.
+ */
+int worker_main(string IP, int port) {
+	Socket *s = new Socket();
+	if (s->Connect(IP, port)) {
+		cout << "ERROR: Cannot connect to the pool" << endl;
+		delete s;
+		return -1;
+	}
+	cout << "Connected to the pool" << endl;
+
+	char buf[BLOCK_MSG_LEN];
+	char out[32];
+	int id = 0, target = 0;
+	bool working = false;
+	uint64_t cur = 0, end = 0, hashes = 0;
+
+	while (1) {
+		s->timeout = working ? POOL_POLL_TIMEOUT : WORKER_IDLE_WAIT;
+		if (s->CheckRead()) {
+			string cmd;
+			if (recv_str(s, &cmd)) break;
+			if (!cmd.compare(0, 4, "JOB ")) {
+				unsigned long long start, count;
+				if (sscanf(cmd.c_str(), "JOB %d %d %llu %llu", &id, &target, &start, &count) != 4) break;
+				s->timeout = 1000000;
+				if (s->Recv(buf, BLOCK_MSG_LEN) != BLOCK_MSG_LEN) break;
+				cur = start;
+				end = start + count;
+				working = true;
+			} else if (!cmd.compare(0, 4, "WAIT")) {
+				working = false;
+			} else {
+				/* DISCONNECT, or something we don't understand */
+				break;
+			}
+			continue;
+		}
+		if (!working) continue;
+
+		/* Count through the first 8 bytes of the nonce */
+		for (int i = 0; i < WORKER_CHECK_EVERY && cur < end; i++, cur++) {
+			memcpy(buf + NONCE_OFFSET, &cur, sizeof(cur));
+			sha256_block(buf, out);
+			hashes++;
+
+			int z = 0;
+			while (z < target && out[z] == '\0') z++;
+			if (z < target) continue;
+
+			cout << "Solved job " << id << " after " << hashes << " hashes" << endl;
+			s->SendStr("SOLVED " + to_string(id));
+			s->Send(buf + NONCE_OFFSET, 32);
+			working = false;
+			break;
+		}
+		if (working && cur >= end) {
+			s->SendStr("DONE " + to_string(id));
+			working = false;
+		}
+	}
+
+	cout << "Lost the pool after " << hashes << " hashes" << endl;
+	delete s;
+	return 0;
+}
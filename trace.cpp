@@ -0,0 +1,105 @@
+/* Standard libraries */
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+/* Custom headers */
+#include <trace.hpp>
+
+using namespace std;
+
+/* Spans each thread can hold before the oldest get overwritten */
+#define TRACE_RING_SIZE (1 << 16)
+
+class TraceEvent {
+public:
+	const char *name;
+	int64_t start;
+	int64_t end;
+};
+
+/* Every thread gets one of these the first time it records a span. Only
+ * that thread writes to it, so there's no locking: it fills in an event
+ * and then bumps head.
+ */
+class TraceRing {
+public:
+	TraceEvent events[TRACE_RING_SIZE];
+	atomic<uint64_t> head;
+	int tid;
+	TraceRing *next;
+};
+
+atomic<bool> trace_enabled(false);
+
+/* All rings ever made, as a list that only ever gets pushed to */
+static atomic<TraceRing*> rings(nullptr);
+static atomic<int> ring_count(0);
+
+/* Anything recorded before this is from an earlier trace */
+static atomic<int64_t> trace_begin(0);
+static string trace_path;
+
+static thread_local TraceRing *my_ring = nullptr;
+
+int64_t trace_now(void) {
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceRing *get_ring(void) {
+	if (my_ring != nullptr) return my_ring;
+	
+	TraceRing *r = new TraceRing();
+	r->head.store(0);
+	r->tid = ring_count.fetch_add(1);
+	r->next = rings.load();
+	while (!rings.compare_exchange_weak(r->next, r)) {}
+	my_ring = r;
+	return r;
+}
+
+void trace_record(const char *name, int64_t start, int64_t end) {
+	TraceRing *r = get_ring();
+	uint64_t h = r->head.load(memory_order_relaxed);
+	TraceEvent &e = r->events[h % TRACE_RING_SIZE];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+	r->head.store(h + 1, memory_order_release);
+}
+
+int trace_start(string path) {
+	trace_path = path;
+	trace_begin.store(trace_now());
+	trace_enabled.store(true);
+	return 0;
+}
+
+int trace_stop(void) {
+	if (!trace_enabled.load()) return -1;
+	trace_enabled.store(false);
+	
+	ofstream f(trace_path);
+	if (!f) return -1;
+	
+	int64_t begin = trace_begin.load();
+	f << "{\"traceEvents\":[";
+	bool first = true;
+	for (TraceRing *r = rings.load(); r != nullptr; r = r->next) {
+		uint64_t h = r->head.load(memory_order_acquire);
+		uint64_t n = (h > TRACE_RING_SIZE) ? TRACE_RING_SIZE : h;
+		for (uint64_t i = h - n; i < h; i++) {
+			TraceEvent &e = r->events[i % TRACE_RING_SIZE];
+			if (e.start < begin) continue;
+			
+			if (!first) f << ",";
+			first = false;
+			f << "\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << r->tid
+			  << ",\"ts\":" << (e.start - begin) << ",\"dur\":" << (e.end - e.start) << "}";
+		}
+	}
+	f << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	return f.good() ? 0 : -1;
+}